@@ -2,110 +2,367 @@
 //Project 1 - Simple Shell
 //Chelsea Chourp & Wei Liew
 
-
+#define _GNU_SOURCE //for memmem, splice, tee and copy_file_range
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+
+extern char **environ;
 
 //Constants used for max arguements and history respectively
 #define maxArg 20 
 #define maxHistory 100
+#define hashBuckets 64
+#define maxJobs 64
 
-//Variables for history
-char **archive;
+//Variables for history, a ring of the last maxHistory commands
+char *archive[maxHistory];
+int historyStart = 0; //slot of the oldest command
 int historySize = 0;
 
+//Variables for the history file. Every command is appended to it and the file is mapped to
+//search it, each line has a bit signature of its 3 letter pieces so most lines that can't
+//match are skipped without looking at the text
+int histFd = -1;
+char *histMap = NULL;
+size_t histMapLen = 0;
+size_t histIndexed = 0;           //bytes of the file whose lines are in the index
+long *histOffsets = NULL;         //where each line starts, histOffsets[histLines] is histIndexed
+unsigned long long *histSigs = NULL;
+int histLines = 0;
+int histCap = 0;
+
+//Variables for the command hash, resolved paths of commands so PATH isn't searched every time
+struct hashEntry{
+  char* name;
+  char* path;
+  int hits;
+  struct hashEntry* next;
+};
+struct hashEntry* commandTable[hashBuckets];
+char* hashedPath = NULL; //PATH the table was filled from, a different PATH empties it
+
+//Variables for background jobs. The SIGCHLD handler reaps their processes as they exit, the
+//"Done" line waits for the next prompt
+struct job{
+  int used;
+  pid_t pids[maxArg]; //0 once reaped
+  int left;           //processes still running
+  pid_t last;         //the last stage, its exit is the job's status
+  int status;
+  char* command;
+};
+struct job jobs[maxJobs];
+char *commandLine = NULL; //the line being run, for the job list
+
+//Variables for timing. Waits add what their children used to the running line's numbers, with
+//trace on every line's numbers are kept for the summary at the end
+struct usage{
+  double wall;
+  double user;
+  double sys;
+  long maxRss;  //kB, the biggest of the line's processes
+  char* command;
+};
+struct usage lineUsage;
+int trace = 0;
+struct usage *traced = NULL;
+int tracedCount = 0;
+
+//Redirections of one command, taken out of its arguments
+struct redirect{
+  char* in;
+  char* out;
+  int append; //>> instead of >
+};
+
+//A cat or tee pipeline stage, run on a thread of the shell with its own copies of the stage's
+//descriptors
+struct mover{
+  pthread_t thread;
+  char* args[maxArg];
+  int in;
+  int out;
+};
+
 //Funct prototype
-void sishell();
+void sishell(FILE*, int);
+void runLine(char*, int);
+void addUsage(struct rusage*);
+void printUsage(struct usage*, char*);
+void traceSummary();
 void addToHist(char*);
 int tokenize(char**, char*[maxArg]);
 int tokenizePipe(char**, char*[maxArg]);
-void exec(char*[maxArg]);
-void execPipe(char*[maxArg],int);
+void exec(char*[maxArg], int);
+int isBuiltin(char*);
+int builtin(char*[maxArg], int, int);
+void execPipe(char*[maxArg], int, int);
+void finishCommand(pid_t*, int, int);
+void reapJobs(int);
+int noteExit(pid_t, int);
+void reportJobs(int);
+void jobsBuiltin();
+void waitBuiltin(char*);
+void parallelFor(char*[maxArg], int);
+int pforWait(pid_t*, int, int*, int*);
 void cd(char*);
-void history(char* arg);
+void history(char*[maxArg]);
+void loadHistory();
+void mapHistory();
+void searchHistory(char*);
+int ringIndex(char*, size_t);
+char* lookupCommand(char*);
+void forgetCommand(char*);
+void clearHash();
+int spawnCommand(pid_t*, char*[maxArg], posix_spawn_file_actions_t*);
+void hash(char*[maxArg]);
+void export(char*);
+int takeRedirects(char*[maxArg], struct redirect*);
+int openRedirects(struct redirect*, int*, int*);
+int isMover(char*);
+int runMover(char*[maxArg], int, int);
+void* moverThread(void*);
+int moveData(int, int);
+int teeData(int, int, int*, int);
+int writeAll(int, char*, size_t);
 
 
 //Program
-//main clears screen + calls shell
+//main clears screen + calls shell. sish [-t] [script]: with a script, or with stdin that isn't a
+//terminal, lines are run as they are read without the clear or the prompt. -t traces the time
+//and memory of every line and prints the costliest ones at the end
 int main(int argc, char **argv)
 {
-	system("clear");
-	sishell();
+	FILE *input = stdin;
+	int first = 1;
+
+	if(argc > first && strcmp(argv[first], "-t") == 0){
+		trace = 1;
+		first++;
+	}
+	if(argc > first + 1){
+		fprintf(stderr, "Usage: %s [-t] [script] \n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if(argc > first){
+		input = fopen(argv[first], "re");
+		if(input == NULL){
+			perror(argv[first]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	int interactive = (argc == first && isatty(STDIN_FILENO));
+	if(interactive)
+		system("clear");
+	sishell(input, interactive);
+	if(trace)
+		traceSummary();
 	
 	return EXIT_SUCCESS;
 }
 
 //Actual Shell
-void sishell()
+void sishell(FILE *input, int interactive)
 {
 	//Initialization variables
 	char *line = NULL;
 	size_t length = 0;
-	char *args[maxArg];
 	int loop = 1;
 
-	//create history
-	archive = malloc(maxHistory*sizeof(char*));
+	//load history from the history file, scripts don't keep history
+	if(interactive)
+		loadHistory();
+
+	//background jobs are reaped as they finish, SA_RESTART keeps getline going through it
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reapJobs;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	//cat and tee write to pipes from inside the shell, a reader that quits early must not kill
+	//it. Children get SIGPIPE back from spawnCommand
+	signal(SIGPIPE, SIG_IGN);
 
 	while(loop) {
-		printf("sish> "); //prompt w/the space
+		reportJobs(0);
+		if(interactive)
+			printf("sish> "); //prompt w/the space
 
-		//read input
-		getline(&line,&length,stdin);
-		line[strlen(line)-1]='\0';
+		//read input, end of input is the same as exit
+		if(getline(&line,&length,input) == -1){
+			if(interactive)
+				printf("\n");
+			return;
+		}
+		if(line[strlen(line)-1] == '\n')
+			line[strlen(line)-1]='\0';
 
-    //loops back if only input is enter
-		if (strcmp(line, "\0") == 0){
+    //loops back if only input is enter, or a comment (#! lines in scripts too)
+		if (strcmp(line, "\0") == 0 || line[0] == '#'){
       continue;
     }
 	
-		//archives input and increases history size if within history max
+		//archives input
 		addToHist(line);
-		if(historySize != maxHistory-1)
-			historySize++;
 
     //Exit command
 		if(strcmp(line, "exit") == 0){
       loop = 0;
       return;
     }
-		
+
+    //a trailing & runs the line in the background
+    int background = 0;
+    char *end = line + strlen(line);
+    while(end > line && end[-1] == ' ')
+      end--;
+    if(end > line && end[-1] == '&'){
+      background = 1;
+      end[-1] = '\0';
+    }
+    free(commandLine);
+    commandLine = strdup(line);
+
+    //time in front times the rest of the line
+    char *run = line;
+    int timed = 0;
+    if(strncmp(line, "time ", 5) == 0){
+      timed = 1;
+      run = line + 5;
+    }
+
+    //the shell's own time is counted too, cat and tee run inside it
+    struct timespec start, stop;
+    struct rusage selfStart, selfStop;
+    memset(&lineUsage, 0, sizeof(lineUsage));
+    getrusage(RUSAGE_SELF, &selfStart);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runLine(run, background);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    getrusage(RUSAGE_SELF, &selfStop);
+    lineUsage.wall = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+    lineUsage.user += (selfStop.ru_utime.tv_sec - selfStart.ru_utime.tv_sec) + (selfStop.ru_utime.tv_usec - selfStart.ru_utime.tv_usec) / 1e6;
+    lineUsage.sys += (selfStop.ru_stime.tv_sec - selfStart.ru_stime.tv_sec) + (selfStop.ru_stime.tv_usec - selfStart.ru_stime.tv_usec) / 1e6;
+
+    if(timed)
+      printUsage(&lineUsage, NULL);
+    if(trace){
+      printUsage(&lineUsage, commandLine);
+      traced = realloc(traced, (tracedCount + 1) * sizeof(struct usage));
+      traced[tracedCount] = lineUsage;
+      traced[tracedCount++].command = strdup(commandLine);
+    }
+	} 
+}
+
+//Runs one line, a single command or a pipeline
+void runLine(char *line, int background)
+{
+	char *args[maxArg];
+
 		//If given input does not need piping to execute
 		if(strchr(line, '|') == NULL){
 		//tokenize input and execute it
 			tokenize(&line,args);
-			exec(args);
+			if(args[0] != NULL)
+				exec(args, background);
 		}
     //If given input needs piping to execute
     else{
       int commandCount = tokenizePipe(&line, args);
-  		execPipe(args,commandCount);
+  		execPipe(args, commandCount, background);
     }
-	} 
 }
 
-//Archives input onto history
+//Adds what a reaped child used to the running line's numbers
+void addUsage(struct rusage *ru)
+{
+  lineUsage.user += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+  lineUsage.sys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+  if(ru->ru_maxrss > lineUsage.maxRss)
+    lineUsage.maxRss = ru->ru_maxrss;
+}
+
+//time's output, and with a command the trace line. Goes to stderr so stdout stays the command's
+void printUsage(struct usage *u, char *command)
+{
+  if(command == NULL)
+    fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ld kB \n", u->wall, u->user, u->sys, u->maxRss);
+  else
+    fprintf(stderr, "+ %.3fs real  %.3fs user  %.3fs sys  %ld kB  %s \n", u->wall, u->user, u->sys, u->maxRss, command);
+}
+
+int compareWall(const void *a, const void *b)
+{
+  double x = ((const struct usage*)a)->wall;
+  double y = ((const struct usage*)b)->wall;
+  return (x < y) - (x > y);
+}
+
+//-t summary: totals, then the costliest lines by wall time
+void traceSummary()
+{
+  struct usage total;
+  memset(&total, 0, sizeof(total));
+  for(int i = 0; i < tracedCount; i++){
+    total.wall += traced[i].wall;
+    total.user += traced[i].user;
+    total.sys += traced[i].sys;
+    if(traced[i].maxRss > total.maxRss)
+      total.maxRss = traced[i].maxRss;
+  }
+  qsort(traced, tracedCount, sizeof(struct usage), compareWall);
+
+  fprintf(stderr, "Summary: %d commands, real %.3fs  user %.3fs  sys %.3fs  maxrss %ld kB \n",
+          tracedCount, total.wall, total.user, total.sys, total.maxRss);
+  fprintf(stderr, "Costliest: \n");
+  for(int i = 0; i < tracedCount && i < 10; i++)
+    printUsage(&traced[i], traced[i].command);
+}
+
+//Archives input onto history and the history file
 void addToHist(char *line)
 {
-	int size = historySize;
+	int slot = (historyStart + historySize) % maxHistory;
 	
-	//If history is already at max then the for-loop deletes
-	//the oldest archived line and shifts all the archives over by one to make
-	//room for the most recent command
-  //Maybe a little inefficent? Can change
-	if(size == maxHistory - 1){
-		for(int i = 0; i < maxHistory -1; i++){
-			archive[i] = archive[i+1];
-		}
-		size--;
+	//If history is already at max the oldest line is dropped and its slot reused
+	if(historySize == maxHistory){
+		free(archive[historyStart]);
+		slot = historyStart;
+		historyStart = (historyStart + 1) % maxHistory;
 	}
+	else
+		historySize++;
 	
 	//Otherwise space is allocated for the most recent entry
-	archive[size] = malloc((strlen(line)+1) * sizeof(char));
-	strcpy(archive[size],line);
+	archive[slot] = strdup(line);
+
+	//one write with O_APPEND, so other sish sessions appending at the same time can't split it
+	if(histFd != -1){
+		size_t len = strlen(line);
+		char *record = malloc(len + 2);
+		memcpy(record, line, len);
+		record[len] = '\n';
+		record[len + 1] = '\0';
+		if(write(histFd, record, len + 1) < 0)
+			perror("History file write failed");
+		free(record);
+	}
 	return;
 }
 
@@ -152,125 +409,489 @@ int tokenizePipe(char** line, char* args[maxArg])
 }
 
 //Execute commands
-void exec(char*args[maxArg])
+void exec(char*args[maxArg], int background)
 {
-	//Built in? Check first element (0) then executes the command located in second element (1)
-  if(strcmp(args[0], "cd") == 0){
-    cd(args[1]);
-    return;
-  }
-  if(strcmp(args[0], "history") == 0){
-    history(args[1]);
+  //< > and >> come out of the arguments first, built ins take them too
+  struct redirect r;
+  int in = STDIN_FILENO, out = STDOUT_FILENO;
+  if(takeRedirects(args, &r) == -1 || openRedirects(&r, &in, &out) == -1)
     return;
+
+  if(args[0] == NULL || builtin(args, in, out))
+    ;
+  //cat and tee in the foreground run in the shell itself, nothing is started for them
+  else if(!background && isMover(args[0])){
+    runMover(args, in, out);
   }
-    
-	//If not built in, built in fork to run process? pid parent id not process id
+	//If not built in, posix_spawn runs it. glibc does that with a vfork style clone so the
+	//shell's memory isn't copied like with fork
 	else{
-	 int pid = fork();
+   posix_spawn_file_actions_t actions;
+   posix_spawn_file_actions_init(&actions);
+   if(in != STDIN_FILENO)
+     posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+   if(out != STDOUT_FILENO)
+     posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+
+	 pid_t pid;
+	 int err = spawnCommand(&pid, args, &actions);
+   posix_spawn_file_actions_destroy(&actions);
   
-    //Error handling
-	 if(pid < 0){
-     perror("Error creating child process. \n");
-     exit(EXIT_FAILURE);
-   }
-	 
-   if(pid == 0){
-       execvp(args[0], args);
-       perror("Invalid input \n");
-       exit(EXIT_FAILURE);
-   }
-	 else{
-       //Included <sys/wait.h> for the command to process
-       wait(NULL);
-       return;
-     }
+   //Error handling, a command that can't be run comes back here instead of from the child
+	 if(err != 0)
+     fprintf(stderr, "%s: %s \n", args[0], strerror(err));
+   else
+     finishCommand(&pid, 1, background);
   }
+
+  if(in != STDIN_FILENO)
+    close(in);
+  if(out != STDOUT_FILENO)
+    close(out);
 	return;
 }
 
-void execPipe(char* args[maxArg], int commandCount){
-  int prev_fd[2] = {STDIN_FILENO, STDOUT_FILENO};
+int isBuiltin(char* name)
+{
+  char* names[] = {"cd", "history", "hash", "export", "jobs", "wait", "pfor", NULL};
+  for(int i = 0; names[i] != NULL; i++){
+    if(strcmp(name, names[i]) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+//Built in? Check first element (0) then executes the command located in second element (1).
+//While it runs stdout is pointed at out, pfor reads its lines from in. Returns 0 for anything
+//that isn't built in
+int builtin(char* args[maxArg], int in, int out)
+{
+  if(!isBuiltin(args[0]))
+    return 0;
+
+  int savedOut = -1;
+  if(out != STDOUT_FILENO){
+    fflush(stdout);
+    savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(out, STDOUT_FILENO);
+  }
+
+  if(strcmp(args[0], "cd") == 0)
+    cd(args[1]);
+  else if(strcmp(args[0], "history") == 0)
+    history(args);
+  else if(strcmp(args[0], "hash") == 0)
+    hash(args);
+  else if(strcmp(args[0], "export") == 0)
+    export(args[1]);
+  else if(strcmp(args[0], "jobs") == 0)
+    jobsBuiltin();
+  else if(strcmp(args[0], "wait") == 0)
+    waitBuiltin(args[1]);
+  else
+    parallelFor(args, in);
+
+  if(savedOut != -1){
+    fflush(stdout);
+    dup2(savedOut, STDOUT_FILENO);
+    close(savedOut);
+  }
+  return 1;
+}
+
+//Every stage is started before any is waited for so they all run at once, a stage writing
+//more than a pipe buffer would otherwise block with nobody reading
+void execPipe(char* args[maxArg], int commandCount, int background){
+  int prevRead = STDIN_FILENO;
   int fd[2];
+  pid_t pids[maxArg];
+  int started = 0;
+  struct mover movers[maxArg];
+  int moving = 0;
 
   for(int i = 0; i < commandCount; i++){
     //splits a given command according to " "
     char* line = args[i];
-    char* command[strlen(line)];
+    char* command[strlen(line) + 2];
     tokenize(&line, command);
     
+    int out = STDOUT_FILENO;
     if (i < commandCount -1){
-      if(pipe(fd) == -1){
+      //close on exec, so children only get the ends they are handed as stdin/stdout
+      if(pipe2(fd, O_CLOEXEC) == -1){
         perror("Pipe failure.");
         exit(EXIT_FAILURE);
       }
-      prev_fd[1] = fd[1];
+      out = fd[1];
     }
-    else{
-      prev_fd[1] = STDOUT_FILENO;
+
+    //< and > take the place of the pipe ends for this stage
+    struct redirect r;
+    int stageIn = prevRead, stageOut = out;
+    int redirected = (takeRedirects(command, &r) == 0 && openRedirects(&r, &stageIn, &stageOut) == 0);
+
+    //error handling, the rest of the pipeline still runs and just sees an empty pipe
+    if(!redirected)
+      ;
+    else if(command[0] == NULL){
+      fprintf(stderr, "Empty pipeline stage. \n");
     }
-    
-      
-    //fork a child process to execute command
-    pid_t cpid = fork();
-    //error handling
-    if(cpid == -1){
-      perror("Fork failure.");
-      exit(EXIT_FAILURE);
-    }
-
-    //child process
-    if(cpid == 0){
-      if(prev_fd[0] != STDIN_FILENO){
-        dup2(prev_fd[0],STDIN_FILENO);
-        close(prev_fd[0]);
+    //pfor as the last stage takes its lines from the pipe, like xargs
+    else if(i == commandCount - 1 && strcmp(command[0], "pfor") == 0){
+      parallelFor(command, stageIn);
+    }
+    //cat and tee run on a thread instead of a process, once the pipe ends are closed below the
+    //thread's copies are the only ones left so the next stage still sees the end of its input
+    else if(!background && isMover(command[0])){
+      struct mover* m = &movers[moving];
+      int count = 0;
+      for(; command[count] != NULL && count < maxArg - 1; count++)
+        m->args[count] = command[count];
+      m->args[count] = NULL;
+      m->in = (stageIn == STDIN_FILENO) ? STDIN_FILENO : fcntl(stageIn, F_DUPFD_CLOEXEC, 0);
+      m->out = (stageOut == STDOUT_FILENO) ? STDOUT_FILENO : fcntl(stageOut, F_DUPFD_CLOEXEC, 0);
+      if(pthread_create(&m->thread, NULL, moverThread, m) != 0){
+        fprintf(stderr, "%s: could not start a thread \n", command[0]);
+        moverThread(m);
       }
-      if(prev_fd[1] != STDOUT_FILENO){
-        dup2(prev_fd[1], STDOUT_FILENO);
-        close(prev_fd[1]);
+      else
+        moving++;
+    }
+    else{
+      //the child gets the stage's ends as stdin/stdout, everything else it would inherit is
+      //close on exec
+      posix_spawn_file_actions_t actions;
+      posix_spawn_file_actions_init(&actions);
+      if(stageIn != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, stageIn, STDIN_FILENO);
+      if(stageOut != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, stageOut, STDOUT_FILENO);
+
+      int err = spawnCommand(&pids[started], command, &actions);
+      if(err != 0)
+        fprintf(stderr, "%s: %s \n", command[0], strerror(err));
+      else
+        started++;
+      posix_spawn_file_actions_destroy(&actions);
+    }
+
+    //parent process, update previous file descriptors
+    if(redirected && stageIn != prevRead)
+      close(stageIn);
+    if(redirected && stageOut != out)
+      close(stageOut);
+    if(prevRead != STDIN_FILENO)
+      close(prevRead);
+    if(out != STDOUT_FILENO){
+      close(out);
+      prevRead = fd[0];
+    }
+  }
+
+  //wait for every stage once the last one is running
+  for(int i = 0; i < moving; i++)
+    pthread_join(movers[i].thread, NULL);
+  finishCommand(pids, started, background);
+}
+
+//Foreground commands are waited for here, background ones go in the job list
+void finishCommand(pid_t* pids, int count, int background)
+{
+  if(count == 0)
+    return;
+  if(!background){
+    for(int i = 0; i < count; i++){
+      struct rusage ru;
+      if(wait4(pids[i], NULL, 0, &ru) == pids[i])
+        addUsage(&ru);
+    }
+    return;
+  }
+
+  //SIGCHLD is held off while the job goes in so the handler sees it whole
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &old);
+  int id = 0;
+  while(id < maxJobs && jobs[id].used)
+    id++;
+  if(id == maxJobs){
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, "Too many jobs, waiting for this one. \n");
+    finishCommand(pids, count, 0);
+    return;
+  }
+  jobs[id].used = 1;
+  jobs[id].left = count;
+  jobs[id].last = pids[count - 1];
+  jobs[id].status = 0;
+  jobs[id].command = strdup(commandLine);
+  for(int i = 0; i < maxArg; i++)
+    jobs[id].pids[i] = (i < count) ? pids[i] : 0;
+  sigprocmask(SIG_SETMASK, &old, NULL);
+
+  //the last process still runs its (possibly already finished) tail, its pid is what bash shows too
+  printf("[%d] %d \n", id + 1, (int)pids[count - 1]);
+
+  //any of them may have exited before it was in the list
+  reapJobs(0);
+}
+
+//Marks a reaped process in the job list, 1 if it was a job's
+int noteExit(pid_t pid, int status)
+{
+  for(int j = 0; j < maxJobs; j++){
+    if(!jobs[j].used)
+      continue;
+    for(int i = 0; i < maxArg; i++){
+      if(jobs[j].pids[i] == pid){
+        jobs[j].pids[i] = 0;
+        jobs[j].left--;
+        if(pid == jobs[j].last)
+          jobs[j].status = status;
+        return 1;
       }
-      int status = execvp(command[0],command);
-      if (status == -1){
-        perror("Execution failed.");
-        exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}
+
+//SIGCHLD handler. Only job processes are reaped, foreground ones are left to their waitpid
+void reapJobs(int sig)
+{
+  int saved = errno;
+  (void)sig;
+  for(int j = 0; j < maxJobs; j++){
+    for(int i = 0; jobs[j].used && i < maxArg; i++){
+      int status;
+      pid_t pid = jobs[j].pids[i];
+      if(pid > 0 && waitpid(pid, &status, WNOHANG) == pid)
+        noteExit(pid, status);
+    }
+  }
+  errno = saved;
+}
+
+//Prints the jobs that finished and frees their slots, with all set the running ones too
+void reportJobs(int all)
+{
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &old);
+  for(int j = 0; j < maxJobs; j++){
+    if(!jobs[j].used)
+      continue;
+    if(jobs[j].left > 0){
+      if(all)
+        printf("[%d] Running    %s \n", j + 1, jobs[j].command);
+      continue;
+    }
+    if(WIFEXITED(jobs[j].status) && WEXITSTATUS(jobs[j].status) == 0)
+      printf("[%d] Done       %s \n", j + 1, jobs[j].command);
+    else if(WIFEXITED(jobs[j].status))
+      printf("[%d] Exit %-5d %s \n", j + 1, WEXITSTATUS(jobs[j].status), jobs[j].command);
+    else
+      printf("[%d] Killed     %s \n", j + 1, jobs[j].command);
+    free(jobs[j].command);
+    jobs[j].used = 0;
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//jobs built in command
+void jobsBuiltin()
+{
+  reportJobs(1);
+}
+
+//wait built in command, waits for every job or just %N
+void waitBuiltin(char* arg)
+{
+  int only = -1;
+  if(arg != NULL){
+    only = atoi(arg[0] == '%' ? arg + 1 : arg) - 1;
+    if(only < 0 || only >= maxJobs || !jobs[only].used){
+      printf("wait: no such job %s \n", arg);
+      return;
+    }
+  }
+
+  //with SIGCHLD held off the handler can't reap them from under us
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &old);
+  for(int j = 0; j < maxJobs; j++){
+    if(!jobs[j].used || (only >= 0 && j != only))
+      continue;
+    for(int i = 0; i < maxArg; i++){
+      int status;
+      pid_t pid = jobs[j].pids[i];
+      if(pid > 0 && waitpid(pid, &status, 0) == pid)
+        noteExit(pid, status);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+//Waits for any child for pfor. Jobs' processes go to the job list and earlier stages of the
+//pipeline pfor ends are just reaped (their waitpid later finds nothing), only pfor's own free a
+//slot. -1 if there are no children left at all
+int pforWait(pid_t* mine, int slots, int* running, int* failed)
+{
+  int status;
+  struct rusage ru;
+  pid_t pid = wait4(-1, &status, 0, &ru);
+  if(pid == -1)
+    return -1;
+  if(noteExit(pid, status))
+    return 0;
+  addUsage(&ru);
+  for(int i = 0; i < slots; i++){
+    if(mine[i] == pid){
+      mine[i] = 0;
+      (*running)--;
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        (*failed)++;
+    }
+  }
+  return 0;
+}
+
+//pfor built in command: pfor [-P slots] command [args...] runs the command once per input line,
+//slots at a time (one per cpu by default). The line replaces {} in the arguments, without a {}
+//it goes on the end. Lines come from the pipe when pfor ends a pipeline, otherwise from stdin
+void parallelFor(char* args[maxArg], int inFd)
+{
+  int slots = sysconf(_SC_NPROCESSORS_ONLN);
+  int first = 1;
+  if(args[1] != NULL && strcmp(args[1], "-P") == 0){
+    if(args[2] == NULL || atoi(args[2]) < 1){
+      printf("Usage: pfor [-P slots] command [args...] \n");
+      return;
+    }
+    slots = atoi(args[2]);
+    first = 3;
+  }
+  if(args[first] == NULL){
+    printf("Usage: pfor [-P slots] command [args...] \n");
+    return;
+  }
+
+  //a pipe is read through its own FILE on a copy of the descriptor (close on exec, the
+  //commands started here mustn't hold the pipe open), stdin through stdin so nothing it
+  //already buffered is lost
+  FILE *in = (inFd == STDIN_FILENO) ? stdin : fdopen(fcntl(inFd, F_DUPFD_CLOEXEC, 0), "re");
+  char *line = NULL;
+  size_t length = 0;
+  ssize_t len;
+  int running = 0, ran = 0, failed = 0;
+  pid_t *mine = calloc(slots, sizeof(pid_t));
+
+  //SIGCHLD held off: any child we get from waitpid is either ours or a job's
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &block, &old);
+
+  while((len = getline(&line, &length, in)) != -1){
+    if(len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if(len == 0)
+      continue;
+
+    //the command for this line
+    char *command[maxArg + 1];
+    int count = 0, placed = 0;
+    for(int i = first; args[i] != NULL && count < maxArg - 1; i++){
+      if(strcmp(args[i], "{}") == 0){
+        command[count++] = line;
+        placed = 1;
       }
+      else
+        command[count++] = args[i];
     }
+    if(!placed)
+      command[count++] = line;
+    command[count] = NULL;
 
-    //parent process
-    else{
-     //wait for child to complete
-      wait(NULL);
-      //update previous file decriptors
+    //every slot busy, wait for one of ours to finish
+    while(running == slots && pforWait(mine, slots, &running, &failed) == 0)
+      ;
+
+    pid_t pid;
+    int err = spawnCommand(&pid, command, NULL);
+    if(err != 0){
+      fprintf(stderr, "%s: %s \n", command[0], strerror(err));
+      failed++;
+      continue;
     }
-    if (i < commandCount-1){
-      close(fd[1]);
-      prev_fd[0] = fd[0];
+    for(int i = 0; i < slots; i++){
+      if(mine[i] == 0){
+        mine[i] = pid;
+        break;
+      }
     }
+    running++;
+    ran++;
   }
+
+  while(running > 0 && pforWait(mine, slots, &running, &failed) == 0)
+    ;
+  sigprocmask(SIG_SETMASK, &old, NULL);
+
+  if(inFd == STDIN_FILENO)
+    clearerr(stdin);
+  else
+    fclose(in);
+  free(line);
+  free(mine);
+  printf("pfor: %d commands run, %d failed \n", ran, failed);
 }
 
 
 //Part 2: exit, history, cd
 //History built-in command
-void history(char* arg)
+void history(char* args[maxArg])
 {
 	int *size = &historySize;
+	char *arg = args[1];
 
-	//-c, clear hist one by one, set archive size to 0
+	//-c, clear hist one by one, set archive size to 0. The history file is kept
 	if(arg != NULL && strcmp(arg,"-c") == 0){
 		for(int i = 0; i<*size; i++){	
-			archive[i] = NULL;
+			free(archive[(historyStart + i) % maxHistory]);
+			archive[(historyStart + i) % maxHistory] = NULL;
 		}
 
 		*size = 0;
+		historyStart = 0;
     printf("History cleared. \n");
 		return;
 	}
 
+	//-s, search the whole history file for lines holding the rest of the line
+	if(arg != NULL && strcmp(arg,"-s") == 0){
+		char query[1024] = "";
+		for(int i = 2; args[i] != NULL; i++){
+			if(i > 2)
+				strncat(query, " ", sizeof(query) - strlen(query) - 1);
+			strncat(query, args[i], sizeof(query) - strlen(query) - 1);
+		}
+		if(query[0] == '\0')
+			printf("Usage: history -s substring \n");
+		else
+			searchHistory(query);
+		return;
+	}
+
 	//Otherwise just print out last 100
 	if(arg == NULL){
     printf("History: \n");
 		for(int i = 0; i <*size; i++){
-      printf(" %d %s \n", i, archive[i]);
+      printf(" %d %s \n", i, archive[(historyStart + i) % maxHistory]);
 		}
 	}
 
@@ -288,23 +909,584 @@ void history(char* arg)
       char* arg[maxArg];
 
       //If everythings good to go then it executes the command
-      line = malloc((strlen(archive[index])+1));
-      strcpy(line, archive[index]);
+      line = strdup(archive[(historyStart + index) % maxHistory]);
 
       if(strchr(line, '|') == NULL){
         tokenize(&line,arg);
-        exec(arg);
+        exec(arg, 0);
        }
-      
+      free(line);
     }
 	}
 }
 
+//Opens the history file ($HISTFILE, or ~/.sish_history) and fills the ring with its last
+//lines. Only those are copied, the rest stays in the mapping until a search needs it
+void loadHistory()
+{
+  char path[4096];
+  char *file = getenv("HISTFILE");
+  if(file == NULL){
+    char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.sish_history", (home != NULL) ? home : ".");
+    file = path;
+  }
+
+  histFd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if(histFd == -1){
+    perror("History file not available");
+    return;
+  }
+  mapHistory();
+
+  int first = (histLines > maxHistory) ? histLines - maxHistory : 0;
+  for(int i = first; i < histLines; i++){
+    int len = histOffsets[i + 1] - histOffsets[i] - 1;
+    archive[historySize++] = strndup(histMap + histOffsets[i], len);
+  }
+}
+
+//bit signature of the 3 letter pieces of a string, a line can only hold a query if it has
+//every bit the query has
+unsigned long long signature(const char *text, size_t len)
+{
+  unsigned long long sig = 0;
+  for(size_t i = 0; i + 2 < len; i++){
+    unsigned int piece = ((unsigned char)text[i] << 16) | ((unsigned char)text[i + 1] << 8) | (unsigned char)text[i + 2];
+    sig |= 1ULL << ((piece * 2654435761u) >> 26);
+  }
+  return sig;
+}
+
+//Maps whatever the history file has grown to (this or another session appended since) and
+//adds its new whole lines to the index
+void mapHistory()
+{
+  struct stat st;
+  if(histFd == -1 || fstat(histFd, &st) == -1 || (size_t)st.st_size == histMapLen)
+    return;
+
+  if(histMap != NULL)
+    munmap(histMap, histMapLen);
+  histMap = NULL;
+  histMapLen = 0;
+  //a file that shrank (cut or rewritten elsewhere) is indexed again from the start, the old
+  //index points past its end
+  if((size_t)st.st_size < histIndexed){
+    histIndexed = 0;
+    histLines = 0;
+  }
+  if(st.st_size == 0)
+    return;
+  histMap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, histFd, 0);
+  if(histMap == MAP_FAILED){
+    perror("History file map failed");
+    histMap = NULL;
+    histMapLen = 0;
+    return;
+  }
+  histMapLen = st.st_size;
+
+  if(histOffsets == NULL){
+    histCap = 1024;
+    histOffsets = malloc((histCap + 1) * sizeof(long));
+    histSigs = malloc(histCap * sizeof(unsigned long long));
+    histOffsets[0] = 0;
+  }
+  char *end;
+  while(histIndexed < histMapLen && (end = memchr(histMap + histIndexed, '\n', histMapLen - histIndexed)) != NULL){
+    if(histLines == histCap){
+      histCap *= 2;
+      histOffsets = realloc(histOffsets, (histCap + 1) * sizeof(long));
+      histSigs = realloc(histSigs, histCap * sizeof(unsigned long long));
+    }
+    histSigs[histLines] = signature(histMap + histIndexed, end - (histMap + histIndexed));
+    histIndexed = end - histMap + 1;
+    histOffsets[++histLines] = histIndexed;
+  }
+}
+
+//Ring index of the newest history entry that reads text, -1 when it has rolled out of the ring
+int ringIndex(char *text, size_t len)
+{
+  for(int i = historySize - 1; i >= 0; i--){
+    char *entry = archive[(historyStart + i) % maxHistory];
+    if(strlen(entry) == len && strncmp(entry, text, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+//history -s: every line of the history file holding query, newest first. Numbered the same
+//way as plain history so history N runs it, lines older than the ring get a - instead
+void searchHistory(char *query)
+{
+  size_t qlen = strlen(query);
+  unsigned long long qsig = signature(query, qlen);
+  int found = 0;
+
+  mapHistory();
+  for(int i = histLines - 1; i >= 0; i--){
+    if((histSigs[i] & qsig) != qsig)
+      continue;
+    char *text = histMap + histOffsets[i];
+    size_t len = histOffsets[i + 1] - histOffsets[i] - 1;
+    //searches match themselves, this one included, so they are left out
+    if(len >= 10 && strncmp(text, "history -s", 10) == 0)
+      continue;
+    if(memmem(text, len, query, qlen) != NULL){
+      int index = ringIndex(text, len);
+      if(index >= 0)
+        printf(" %d %.*s \n", index, (int)len, text);
+      else
+        printf(" - %.*s \n", (int)len, text);
+      found++;
+    }
+  }
+  if(found == 0)
+    printf("No history matches \"%s\". \n", query);
+}
+
 //cd built in command
 void cd(char* directory)
 {
   //cd is built in, if no such directory exists then error message.
-  if(chdir(directory) < 0)
+  if(chdir(directory) < 0){
     perror("Directory not found. \n");    
+    return;
+  }
+
+  //commands hashed through a relative PATH entry ("", ".", bin...) were found from the old
+  //directory, so with one of those in PATH the table starts over
+  for(char* dir = hashedPath; dir != NULL; dir = strchr(dir, ':')){
+    if(*dir == ':')
+      dir++;
+    if(*dir != '/'){
+      clearHash();
+      break;
+    }
+  }
   return;
 }
+
+//Part 3: command hash
+//string hash for the bucket
+unsigned int hashName(char* name)
+{
+  unsigned int h = 5381;
+  while(*name != '\0')
+    h = h * 33 + (unsigned char)*name++;
+  return h % hashBuckets;
+}
+
+//Empties the command hash
+void clearHash()
+{
+  for(int i = 0; i < hashBuckets; i++){
+    struct hashEntry* entry = commandTable[i];
+    while(entry != NULL){
+      struct hashEntry* next = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      entry = next;
+    }
+    commandTable[i] = NULL;
+  }
+}
+
+//Drops one command from the hash
+void forgetCommand(char* name)
+{
+  struct hashEntry** link = &commandTable[hashName(name)];
+  while(*link != NULL){
+    if(strcmp((*link)->name, name) == 0){
+      struct hashEntry* entry = *link;
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+//Full path of a command, from the hash or else by searching PATH once and remembering it.
+//Names with a slash are used as they are. NULL if it isn't anywhere in PATH
+char* lookupCommand(char* name)
+{
+  char* path = getenv("PATH");
+  if(path == NULL)
+    path = "/bin:/usr/bin";
+  if(strchr(name, '/') != NULL)
+    return name;
+
+  //PATH changed since the table was filled so everything in it may be wrong
+  if(hashedPath == NULL || strcmp(hashedPath, path) != 0){
+    clearHash();
+    free(hashedPath);
+    hashedPath = strdup(path);
+  }
+
+  unsigned int bucket = hashName(name);
+  for(struct hashEntry* entry = commandTable[bucket]; entry != NULL; entry = entry->next){
+    if(strcmp(entry->name, name) == 0){
+      entry->hits++;
+      return entry->path;
+    }
+  }
+
+  //search PATH like execvp does, an empty entry is the current directory
+  char* dirs = strdup(path);
+  char* rest = dirs;
+  char* found = NULL;
+  struct stat st;
+  while(found == NULL && rest != NULL){
+    char* dir = strsep(&rest, ":");
+    char candidate[4096];
+    snprintf(candidate, sizeof(candidate), "%s/%s", (*dir == '\0') ? "." : dir, name);
+    if(stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+      found = strdup(candidate);
+  }
+  free(dirs);
+  if(found == NULL)
+    return NULL;
+
+  struct hashEntry* entry = malloc(sizeof(struct hashEntry));
+  entry->name = strdup(name);
+  entry->path = found;
+  entry->hits = 1;
+  entry->next = commandTable[bucket];
+  commandTable[bucket] = entry;
+  return found;
+}
+
+//Starts a command through the hash, returns 0 or an errno like posix_spawn does
+int spawnCommand(pid_t* pid, char* args[maxArg], posix_spawn_file_actions_t* actions)
+{
+  char* path = lookupCommand(args[0]);
+  if(path == NULL)
+    return ENOENT;
+
+  //what builtins printed goes out before the child's output, a script's stdout is fully
+  //buffered
+  fflush(stdout);
+
+  //children start with nothing blocked (pfor holds SIGCHLD off) and with SIGPIPE back to
+  //normal, the shell ignores it
+  posix_spawnattr_t attr;
+  sigset_t none, pipeSignal;
+  sigemptyset(&none);
+  sigemptyset(&pipeSignal);
+  sigaddset(&pipeSignal, SIGPIPE);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setsigdefault(&attr, &pipeSignal);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+  int err = posix_spawn(pid, path, actions, &attr, args, environ);
+  //a hashed command that was moved or deleted since gets looked up again, like bash does
+  if(err == ENOENT && path != args[0]){
+    forgetCommand(args[0]);
+    path = lookupCommand(args[0]);
+    if(path == NULL)
+      err = ENOENT;
+    else
+      err = posix_spawn(pid, path, actions, &attr, args, environ);
+  }
+  posix_spawnattr_destroy(&attr);
+  return err;
+}
+
+//hash built in command: lists the hashed commands, -r forgets them all and names get looked up
+//and added
+void hash(char* args[maxArg])
+{
+  if(args[1] == NULL){
+    int count = 0;
+    for(int i = 0; i < hashBuckets; i++){
+      for(struct hashEntry* entry = commandTable[i]; entry != NULL; entry = entry->next){
+        if(count++ == 0)
+          printf("hits    command \n");
+        printf("%4d    %s \n", entry->hits, entry->path);
+      }
+    }
+    if(count == 0)
+      printf("hash: hash table empty \n");
+    return;
+  }
+
+  if(strcmp(args[1], "-r") == 0){
+    clearHash();
+    return;
+  }
+
+  for(int i = 1; args[i] != NULL; i++){
+    forgetCommand(args[i]);
+    if(lookupCommand(args[i]) == NULL)
+      fprintf(stderr, "hash: %s: not found \n", args[i]);
+  }
+}
+
+//export built in command, sets an environment variable (a new PATH empties the command hash)
+void export(char* assignment)
+{
+  char* value;
+  if(assignment == NULL || (value = strchr(assignment, '=')) == NULL){
+    printf("Usage: export NAME=value \n");
+    return;
+  }
+  *value = '\0';
+  if(setenv(assignment, value + 1, 1) < 0)
+    perror("export failed");
+  //emptied right away so hash doesn't list paths from the old PATH
+  else if(strcmp(assignment, "PATH") == 0 && (hashedPath == NULL || strcmp(hashedPath, value + 1) != 0)){
+    clearHash();
+    free(hashedPath);
+    hashedPath = strdup(value + 1);
+  }
+  *value = '=';
+}
+
+
+//Part 4: redirection, cat and tee
+//Takes < file, > file and >> file (or <file, >file, >>file) out of a command's arguments
+int takeRedirects(char* args[maxArg], struct redirect* r)
+{
+  memset(r, 0, sizeof(*r));
+  int kept = 0;
+  for(int i = 0; args[i] != NULL; i++){
+    char* arg = args[i];
+    char** target = NULL;
+    if(arg[0] == '<'){
+      target = &r->in;
+      arg++;
+    }
+    else if(arg[0] == '>'){
+      target = &r->out;
+      r->append = (arg[1] == '>');
+      arg += 1 + r->append;
+    }
+    if(target == NULL){
+      args[kept++] = args[i];
+      continue;
+    }
+
+    //the file is the rest of the word or the next one
+    if(arg[0] == '\0')
+      arg = args[++i];
+    if(arg == NULL){
+      fprintf(stderr, "Missing file name after %s \n", args[i - 1]);
+      return -1;
+    }
+    *target = arg;
+  }
+  args[kept] = NULL;
+  return 0;
+}
+
+//Opens a command's redirections, in and out are only changed if both opened. They are close on
+//exec like the pipes, whoever runs the command gets them by dup2
+int openRedirects(struct redirect* r, int* in, int* out)
+{
+  int inFd = *in, outFd = *out;
+  if(r->in != NULL){
+    inFd = open(r->in, O_RDONLY | O_CLOEXEC);
+    if(inFd == -1){
+      perror(r->in);
+      return -1;
+    }
+  }
+  if(r->out != NULL){
+    outFd = open(r->out, O_WRONLY | O_CREAT | O_CLOEXEC | (r->append ? O_APPEND : O_TRUNC), 0644);
+    if(outFd == -1){
+      perror(r->out);
+      if(r->in != NULL)
+        close(inFd);
+      return -1;
+    }
+  }
+  *in = inFd;
+  *out = outFd;
+  return 0;
+}
+
+int isMover(char* name)
+{
+  return strcmp(name, "cat") == 0 || strcmp(name, "tee") == 0;
+}
+
+//cat and tee built in commands, run by the shell on the given descriptors. cat [file...] copies
+//the files (in for none or -) to out, tee [-a] file... copies in to out and to the files
+int runMover(char* args[maxArg], int in, int out)
+{
+  int err = 0;
+  fflush(stdout);
+  if(strcmp(args[0], "cat") == 0){
+    if(args[1] == NULL)
+      err = moveData(in, out);
+    for(int i = 1; args[i] != NULL && err == 0; i++){
+      int fd = (strcmp(args[i], "-") == 0) ? in : open(args[i], O_RDONLY | O_CLOEXEC);
+      if(fd == -1){
+        fprintf(stderr, "cat: %s: %s \n", args[i], strerror(errno));
+        continue;
+      }
+      err = moveData(fd, out);
+      if(fd != in)
+        close(fd);
+    }
+  }
+  else{
+    int first = 1;
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+    if(args[1] != NULL && strcmp(args[1], "-a") == 0){
+      flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND;
+      first = 2;
+    }
+    int files[maxArg];
+    int count = 0;
+    for(int i = first; args[i] != NULL; i++){
+      files[count] = open(args[i], flags, 0644);
+      if(files[count] == -1)
+        fprintf(stderr, "tee: %s: %s \n", args[i], strerror(errno));
+      else
+        count++;
+    }
+    err = teeData(in, out, files, count);
+    for(int i = 0; i < count; i++)
+      close(files[i]);
+  }
+
+  //a reader that stopped early isn't an error worth printing
+  if(err == -1 && errno != EPIPE)
+    fprintf(stderr, "%s: %s \n", args[0], strerror(errno));
+  return err;
+}
+
+void* moverThread(void* arg)
+{
+  struct mover* m = arg;
+  runMover(m->args, m->in, m->out);
+  if(m->in != STDIN_FILENO)
+    close(m->in);
+  if(m->out != STDOUT_FILENO)
+    close(m->out);
+  return NULL;
+}
+
+//Moves everything from in to out with the kernel doing the copying where it can:
+//copy_file_range between two files, sendfile out of a file, splice when either end is a pipe.
+//What none of them take (a pipe to a terminal, say) goes through read and write. -1 with errno
+//if it failed
+int moveData(int in, int out)
+{
+  struct stat inStat, outStat;
+  if(fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1)
+    return -1;
+  int useCopy = S_ISREG(inStat.st_mode) && S_ISREG(outStat.st_mode);
+  int useSend = S_ISREG(inStat.st_mode);
+  int useSplice = S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode);
+  char buf[65536];
+
+  while(1){
+    ssize_t n;
+    if(useCopy)
+      n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    else if(useSend)
+      n = sendfile(out, in, NULL, 1 << 30);
+    else if(useSplice)
+      n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE);
+    else{
+      n = read(in, buf, sizeof(buf));
+      if(n > 0 && writeAll(out, buf, n) == -1)
+        return -1;
+    }
+
+    if(n == 0)
+      return 0;
+    if(n == -1){
+      if(errno == EINTR)
+        continue;
+      //these two files don't do that one (O_APPEND, other filesystems...), nothing was moved so
+      //the next way starts where it stopped
+      if(errno == EINVAL || errno == EXDEV || errno == EBADF || errno == ENOSYS || errno == EOPNOTSUPP){
+        if(useCopy){
+          useCopy = 0;
+          continue;
+        }
+        if(useSend){
+          useSend = 0;
+          continue;
+        }
+        if(useSplice){
+          useSplice = 0;
+          continue;
+        }
+      }
+      return -1;
+    }
+  }
+}
+
+//tee's copying. From a pipe to a pipe with one file, tee() puts what's waiting in the pipe into
+//out as well and splice then moves those same bytes to the file, so none of it passes through
+//here. Anything else reads and writes
+int teeData(int in, int out, int* files, int count)
+{
+  struct stat inStat, outStat;
+  if(fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1)
+    return -1;
+  char buf[65536];
+  ssize_t n;
+
+  if(count == 1 && S_ISFIFO(inStat.st_mode) && S_ISFIFO(outStat.st_mode)){
+    while((n = tee(in, out, 1 << 20, 0)) != 0){
+      if(n == -1 && errno == EINTR)
+        continue;
+      if(n == -1)
+        return -1;
+      while(n > 0){
+        ssize_t moved = splice(in, NULL, files[0], NULL, n, SPLICE_F_MOVE);
+        //a file splice can't write to gets those bytes read out of the pipe instead
+        if(moved == -1 && errno == EINVAL){
+          moved = read(in, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf));
+          if(moved > 0 && writeAll(files[0], buf, moved) == -1)
+            return -1;
+        }
+        if(moved == -1 && errno == EINTR)
+          continue;
+        if(moved <= 0)
+          return -1;
+        n -= moved;
+      }
+    }
+    return 0;
+  }
+
+  while((n = read(in, buf, sizeof(buf))) != 0){
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1 || writeAll(out, buf, n) == -1)
+      return -1;
+    for(int i = 0; i < count; i++){
+      if(writeAll(files[i], buf, n) == -1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+int writeAll(int fd, char* buf, size_t len)
+{
+  while(len > 0){
+    ssize_t n = write(fd, buf, len);
+    if(n == -1 && errno == EINTR)
+      continue;
+    if(n == -1)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
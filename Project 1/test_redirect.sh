@@ -0,0 +1,35 @@
+#!/bin/sh
+# Checks redirection on built ins: builds sish, runs a script and looks at the files it wrote.
+# Run from anywhere: sh test_redirect.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+gcc -o "$dir/sish" "$(dirname "$0")/sish.c" || exit 1
+cd "$dir" || exit 1
+
+printf 'a\nb\n' > lines
+cat > script <<'END'
+sleep 1 &
+jobs > jobsout
+pfor -P 2 echo got < lines > pforout
+wait
+END
+./sish script < /dev/null > /dev/null
+
+fail=0
+check() {
+  if ! grep -q "$2" "$1" 2>/dev/null; then
+    echo "FAIL: $1 has no \"$2\""
+    fail=1
+  fi
+}
+check jobsout "Running    sleep 1"
+check pforout "^got a$"
+check pforout "^got b$"
+check pforout "pfor: 2 commands run, 0 failed"
+if grep -q "<" pforout 2>/dev/null; then
+  echo "FAIL: pfor got the redirection as arguments"
+  fail=1
+fi
+
+[ $fail -eq 0 ] && echo "redirect tests OK"
+exit $fail
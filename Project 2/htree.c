@@ -1,178 +1,1371 @@
-#include <stdio.h>     
-#include <stdlib.h>   
-#include <stdint.h>  
-#include <inttypes.h>  
-#include <errno.h>     // for EINTR
-#include <fcntl.h>     
-#include <unistd.h>    
+#define _GNU_SOURCE    // for nftw
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <string.h>
 #include <sys/mman.h>
-#include <pthread.h>
+#include <ftw.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "common.h"
+#include "htree.h"
 
 // Print out the usage of the program and exit.
 void Usage(char*);
-// Hash function
-uint32_t jenkins_one_at_a_time_hash(const uint8_t* , uint64_t );
+uint64_t parse_size(const char*);
+int parse_hash(const char*);
+int placement_opt(struct htreeConfig*, int, char*);
+long huge_kb();
+long cached_kb(int, uint64_t);
+void print_engine(struct htree*, struct htreeConfig*);
+void print_kernel(int);
+int hash_files(char*, char*, struct htreeConfig*);
+int bench(int, char**);
+int prove(int, char**);
+int verify(int, char**);
+int coord(int, char**);
+int serve(int, char**);
 
-void* tree(void*);
+int main(int argc, char** argv)
+{
+  int32_t fd;
+  uint64_t nblocks;
+  int opt;
+  long long streamSize = -1;
+  char* sidecar = NULL;
+  uint64_t* ranges = NULL;
+  uint numRanges = 0;
+  char* listFile = NULL;
+  int compare = 0;
+  struct htreeConfig cfg;
 
-// block size
-#define BSIZE 4096
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+  cfg.blockSize = HTREE_BSIZE;
+  cfg.hashKind = HTREE_JENKINS;
+  cfg.queueDepth = 8;
 
-struct treeParam{
-  uint numThread;
-  uint chunkSize;
-  uint tid;
-  uint8_t* mapAddr;
-};
+  // "htree bench ..." runs the benchmark sweep instead
+  if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    return bench(argc - 1, argv + 1);
+  // "htree prove/verify ..." make and check the inclusion proof of a single block
+  if (argc > 1 && strcmp(argv[1], "prove") == 0)
+    return prove(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "verify") == 0)
+    return verify(argc - 1, argv + 1);
+  // "htree coord/serve ..." spread one tree over worker processes on this or other hosts
+  if (argc > 1 && strcmp(argv[1], "coord") == 0)
+    return coord(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "serve") == 0)
+    return serve(argc - 1, argv + 1);
 
-int main(int argc, char** argv) 
-{
-  int32_t fd;
-  uint32_t nblocks;
+  // -w picks the worker pool size, defaults to one worker per online cpu
+  // -s reads the input instead of mapping it, -n gives the size of a pipe/socket input
+  // -H xxh64 swaps in the wider, faster block hash (gives different values than jenkins)
+  // -m keeps the whole tree in a sidecar file so later runs only rehash what changed,
+  // -D off:len[,off:len...] says which byte ranges changed since the sidecar was written
+  // -b sets the block size (K/M/G suffixes work), chunks are whole blocks
+  // -l hashes every file named in a list (one per line, - for stdin) instead of one file
+  // -p pins workers to cpus, -a none|seq|willneed|populate picks how mapped pages come in,
+  // -T asks for transparent huge pages
+  // -o reads with O_DIRECT through io_uring so cold files don't push everything else out of the
+  // page cache, -q sets how many reads it keeps in flight, -C runs the mmap path after it to compare
+  while ((opt = getopt(argc, argv, "w:sn:H:m:D:b:l:pa:Toq:C")) != -1) {
+    if (placement_opt(&cfg, opt, optarg) == 0)
+      continue;
+    switch (opt) {
+      case 'w':
+        if (atol(optarg) < 1)
+          Usage(argv[0]);
+        cfg.numWorkers = atol(optarg);
+        break;
+      case 's':
+        cfg.streaming = 1;
+        break;
+      case 'n':
+        streamSize = atoll(optarg);
+        break;
+      case 'H':
+        cfg.hashKind = parse_hash(optarg);
+        if (cfg.hashKind == -1)
+          Usage(argv[0]);
+        break;
+      case 'm':
+        sidecar = optarg;
+        break;
+      case 'b':
+        cfg.blockSize = parse_size(optarg);
+        if (cfg.blockSize == 0)
+          Usage(argv[0]);
+        break;
+      case 'l':
+        listFile = optarg;
+        break;
+      case 'o':
+        cfg.direct = 1;
+        break;
+      case 'q':
+        if (atoi(optarg) < 1)
+          Usage(argv[0]);
+        cfg.queueDepth = atoi(optarg);
+        break;
+      case 'C':
+        compare = 1;
+        break;
+      case 'D':
+        for (char* r = strtok(optarg, ","); r != NULL; r = strtok(NULL, ",")) {
+          unsigned long long off, len;
+          if (sscanf(r, "%llu:%llu", &off, &len) != 2)
+            Usage(argv[0]);
+          ranges = realloc(ranges, 2 * (numRanges + 1) * sizeof(uint64_t));
+          ranges[2 * numRanges] = off;
+          ranges[2 * numRanges + 1] = len;
+          numRanges++;
+        }
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+
+  // input checking, with -l only num_threads is left
+  if (argc - optind != (listFile != NULL ? 1 : 2))
+    Usage(argv[0]);
+  if ((cfg.direct && sidecar != NULL) || (compare && !cfg.direct))
+    Usage(argv[0]);
 
-  // input checking 
-  if (argc != 3)
+  // num. of tree nodes as requested by user, these no longer have to match the number of
+  // OS threads since the pool runs them as tasks
+  if (atoi(argv[argc - 1]) < 1)
     Usage(argv[0]);
+  cfg.numThread = atoi(argv[argc - 1]);
 
-  // open input file
-  fd = open(argv[1], O_RDWR);
+  // a file list or a directory gets every file in it hashed on one shared pool
+  struct stat dirStat;
+  if (listFile != NULL || (stat(argv[optind], &dirStat) == 0 && S_ISDIR(dirStat.st_mode))) {
+    if (sidecar != NULL || cfg.streaming)
+      Usage(argv[0]);
+    return hash_files(listFile != NULL ? NULL : argv[optind], listFile, &cfg);
+  }
+
+  // open input file, "-" is stdin
+  if (strcmp(argv[optind], "-") == 0)
+    fd = STDIN_FILENO;
+  else
+    fd = open(argv[optind], O_RDONLY);
   if (fd == -1) {
     perror("open failed");
     exit(EXIT_FAILURE);
   }
-  // use fstat to get file size
+  // use fstat to get file size, pipes and sockets can't tell us so it has to come from -n
   struct stat fileStat;
   fstat(fd, &fileStat);
   off_t fileSize = fileStat.st_size;
-  
-  // calculate nblocks (might need fixing)
-  if (fileSize%BSIZE != 0){
-    nblocks = (fileSize/BSIZE) + 1;
-  }
-  else{
-    nblocks = (fileSize/BSIZE);
-  }
-
-  // num. of threads & block allocation per thread as requested by user for parallel processing
-  uint numThread = atoi(argv[2]);
-  uint numBlocksThread = (nblocks/numThread);
-  uint chunkSize = numBlocksThread * BSIZE;
-  
-  // mapped memory of file
-  uint8_t* mapAddr = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
-
-  // pass required parameters into the tree hash function
-  struct treeParam param;
-  param.numThread = numThread;
-  param.chunkSize = chunkSize;
-  param.tid = 0;
-  param.mapAddr = mapAddr;
+  if (!S_ISREG(fileStat.st_mode)) {
+    if (sidecar != NULL) {
+      fprintf(stderr, "-m needs a regular file \n");
+      exit(EXIT_FAILURE);
+    }
+    if (streamSize < 0) {
+      fprintf(stderr, "%s is not a regular file, give its size with -n \n", argv[optind]);
+      exit(EXIT_FAILURE);
+    }
+    fileSize = streamSize;
+  }
+
+  nblocks = htree_count_blocks(fileSize, cfg.blockSize);
+  uint64_t numBlocksThread = (nblocks/cfg.numThread);
 
   // shows the user num. of blocks within file, and blocks allocated per thread
-  printf(" no. of blocks = %u \n", nblocks);
-  printf("Blocks per thread: %u \n", numBlocksThread);
+  printf(" no. of blocks = %" PRIu64 " \n", nblocks);
+  printf("Blocks per thread: %" PRIu64 " \n", numBlocksThread);
+  printf("Worker threads: %u \n", cfg.numWorkers);
+  print_kernel(cfg.hashKind);
+
+  // workers are started before the clock so only hashing is timed
+  struct htree* ctx = htree_create(&cfg);
+  if (ctx == NULL) {
+    perror("can't start workers");
+    exit(EXIT_FAILURE);
+  }
+  uint numCpus, numNodes;
+  int hugeErr;
+  htree_placement(ctx, &numCpus, &numNodes, &hugeErr);
+  if (cfg.pin)
+    printf("Pinned to %u cpus on %u NUMA nodes \n", numCpus, numNodes);
+
+  // direct runs say how much of the file the page cache held before and after
+  long cachedBefore = 0;
+  if (cfg.direct)
+    cachedBefore = cached_kb(fd, fileSize);
 
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
   double start = GetTime();
 
-  // calculate hash value of the input file
-  pthread_t hashThread;
-  void* hash;
-  
-  pthread_create(&hashThread, NULL, tree, &param);
-  pthread_join(hashThread, &hash);
+  // calculate hash value of the input file. Incremental runs need to get at single chunks so
+  // -m always maps, and with a usable sidecar only the dirty chunks are hashed again
+  uint64_t hash;
+  uint8_t* mapAddr = NULL;
+  struct htree_tree* tree = NULL;
+  int rehash = cfg.numThread;
+  if (sidecar != NULL) {
+    if (fileSize > 0) {
+      mapAddr = htree_map(ctx, fd, fileSize);
+      if (mapAddr == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+      }
+    }
+    tree = htree_tree_load(ctx, sidecar, mapAddr, fileSize, &fileStat, ranges, numRanges, &rehash);
+    if (tree == NULL) {
+      if (errno == ENOENT)
+        fprintf(stderr, "No sidecar yet, hashing everything \n");
+      else
+        fprintf(stderr, "Sidecar doesn't match this file/tree, hashing everything \n");
+      tree = htree_tree_build(ctx, mapAddr, fileSize);
+      rehash = cfg.numThread;
+    }
+    hash = htree_tree_root(tree);
+  }
+  else if (htree_hash_fd(ctx, fd, fileSize, &hash) != 0) {
+    if (errno == EIO)
+      fprintf(stderr, "input ended before %" PRIu64 " bytes \n", (uint64_t)fileSize);
+    else
+      perror("read failed");
+    exit(EXIT_FAILURE);
+  }
 
-  
   double end = GetTime();
-  printf("hash value = %u \n", (uint32_t)(uintptr_t)hash);
+  getrusage(RUSAGE_SELF, &after);
+  printf("hash value = %" PRIu64 " \n", hash);
   printf("time taken = %f \n", (end - start));
-  munmap(mapAddr, fileSize);
+  printf("Page faults: %ld minor, %ld major \n", after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt);
+  if (cfg.huge) {
+    htree_placement(ctx, &numCpus, &numNodes, &hugeErr);
+    if (hugeErr != 0)
+      printf("Huge pages: not allowed (%s) \n", strerror(hugeErr));
+    else
+      printf("Huge pages: %ld kB mapped \n", huge_kb());
+  }
+  if (cfg.direct) {
+    print_engine(ctx, &cfg);
+    printf("Page cache: %ld kB of the file cached before, %ld kB after \n", cachedBefore, cached_kb(fd, fileSize));
+  }
+  if (compare) {
+    // the same file again through the mmap path, after the direct numbers are taken so it
+    // doesn't warm the cache for them
+    struct htreeConfig mmapCfg = cfg;
+    uint64_t mmapHash;
+    mmapCfg.direct = 0;
+    mmapCfg.streaming = 0;
+    struct htree* mmapCtx = htree_create(&mmapCfg);
+    if (mmapCtx == NULL) {
+      perror("can't start workers");
+      exit(EXIT_FAILURE);
+    }
+    getrusage(RUSAGE_SELF, &before);
+    double mmapStart = GetTime();
+    if (htree_hash_fd(mmapCtx, fd, fileSize, &mmapHash) != 0) {
+      perror("mmap run failed");
+      exit(EXIT_FAILURE);
+    }
+    double mmapEnd = GetTime();
+    getrusage(RUSAGE_SELF, &after);
+    printf("mmap path: hash value = %" PRIu64 " (%s), time taken = %f \n", mmapHash,
+           mmapHash == hash ? "same" : "DIFFERENT", (mmapEnd - mmapStart));
+    printf("mmap path: %ld minor, %ld major page faults, %ld kB of the file cached after \n",
+           after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt, cached_kb(fd, fileSize));
+    printf("direct/mmap time: %.2f \n", (end - start) / (mmapEnd - mmapStart));
+    htree_destroy(mmapCtx);
+  }
+  if (sidecar != NULL) {
+    printf("Chunks rehashed: %d of %u \n", rehash, cfg.numThread);
+    if (htree_tree_save(tree, sidecar, &fileStat) != 0) {
+      perror("sidecar write failed");
+      exit(EXIT_FAILURE);
+    }
+    htree_tree_free(tree);
+  }
+  free(ranges);
+  htree_destroy(ctx);
+  if (mapAddr != NULL)
+    munmap(mapAddr, fileSize);
   close(fd);
   return EXIT_SUCCESS;
 }
 
-// the thread
-void* tree(void* arg) 
+// -H's hash name, -1 if it isn't one
+int parse_hash(const char* s)
+{
+  if (strcmp(s, "jenkins") == 0)
+    return HTREE_JENKINS;
+  if (strcmp(s, "xxh64") == 0)
+    return HTREE_XXH64;
+  return -1;
+}
+
+// read a byte count like 4096, 64K, 512M or 2G
+uint64_t parse_size(const char* s)
 {
-  struct treeParam* param = (struct treeParam*) arg;
+  char* end;
+  uint64_t n = strtoull(s, &end, 10);
 
-  uint32_t hashValue = jenkins_one_at_a_time_hash(param->mapAddr + param->tid * param->chunkSize, param->chunkSize);
+  switch (*end) {
+    case 'G': case 'g':
+      n <<= 10;
+      // fall through
+    case 'M': case 'm':
+      n <<= 10;
+      // fall through
+    case 'K': case 'k':
+      n <<= 10;
+      end++;
+  }
+  return (*end == '\0') ? n : 0;
+}
 
-  int leftIndex = 2 * param->tid + 1;
-  int rightIndex = leftIndex + 1;
-  
-  pthread_t left;
-  pthread_t right;
-  void* leftHash;
-  void* rightHash;  
+// split a comma separated list of sizes, returns how many there were
+uint parse_list(char* s, uint64_t* out, uint max)
+{
+  uint count = 0;
 
-  if (leftIndex < param->numThread) {
-    struct treeParam leftParam = *param;
-    leftParam.tid = leftIndex;
-    pthread_create(&left, NULL, tree, &leftParam);
+  for (char* item = strtok(s, ","); item != NULL && count < max; item = strtok(NULL, ",")) {
+    out[count] = parse_size(item);
+    if (out[count] == 0)
+      return 0;
+    count++;
   }
+  return count;
+}
+
+// fill a test file with pseudo random bytes, much faster than /dev/urandom
+int make_bench_file(const char* path, uint64_t size)
+{
+  uint64_t* buf = malloc(1 << 20);
+  uint64_t x = 0x9E3779B97F4A7C15ULL ^ size;
 
-  if (rightIndex < param->numThread) {
-    struct treeParam rightParam = *param;
-    rightParam.tid = rightIndex;
-    pthread_create(&right, NULL, tree, &rightParam);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1) {
+    perror("bench file open failed");
+    free(buf);
+    return -1;
   }
-  
-  if (leftIndex < param->numThread) {
-    pthread_join(left, &leftHash);
+
+  for (uint64_t done = 0; done < size; ) {
+    for (uint i = 0; i < (1 << 20) / sizeof(uint64_t); i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      buf[i] = x;
+    }
+    uint64_t n = (size - done < (1 << 20)) ? size - done : (1 << 20);
+    if (write(fd, buf, n) != (ssize_t)n) {
+      perror("bench file write failed");
+      close(fd);
+      free(buf);
+      return -1;
+    }
+    done += n;
   }
 
-  if (rightIndex < param->numThread) {
-    pthread_join(right, &rightHash);
+  // flushed so a cold run can actually drop the pages
+  fdatasync(fd);
+  free(buf);
+  return fd;
+}
+
+// one timed hash of an already open file, returns seconds or -1
+double bench_run(struct htree* ctx, int fd, uint64_t fileSize)
+{
+  uint64_t hash;
+  double start = GetTime();
+
+  if (htree_hash_fd(ctx, fd, fileSize, &hash) != 0) {
+    perror("bench hash failed");
+    return -1;
   }
+  return GetTime() - start;
+}
+
+// the files of a multi-file run, nftw has no user pointer so the walk adds to these
+struct entry{
+  char* path;
+  uint64_t size;
+};
+static struct entry* entries;
+static uint numEntries;
+static uint walkErrors;
+
+// add one file to the run
+void add_entry(const char* path, uint64_t size)
+{
+  if ((numEntries & (numEntries - 1)) == 0)
+    entries = realloc(entries, (numEntries ? 2 * numEntries : 1) * sizeof(struct entry));
+  entries[numEntries].path = strdup(path);
+  entries[numEntries].size = size;
+  numEntries++;
+}
 
-  if (leftIndex >= param->numThread && rightIndex >= param->numThread) {
-    pthread_exit((void*)(uintptr_t)hashValue);
+// nftw callback, regular files are hashed, symlinks aren't followed and anything else is skipped
+int walk_entry(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  (void)ftw;
+  if (type == FTW_F && S_ISREG(st->st_mode)) {
+    add_entry(path, st->st_size);
+  }
+  else if (type == FTW_DNR || type == FTW_NS) {
+    fprintf(stderr, "%s: can't read \n", path);
+    walkErrors++;
   }
+  return 0;
+}
 
-  char currentHashVal[100];
-  char leftHashVal[100];
-  char rightHashVal[100];
-  char concatHash[300];
-  sprintf(currentHashVal, "%u", hashValue);
-  sprintf(leftHashVal, "%u", (uint32_t)(uintptr_t)leftHash);
-  sprintf(rightHashVal, "%u", (uint32_t)(uintptr_t)rightHash);
+// read a list of files, one path per line, "-" reads the list from stdin. Files that can't be
+// hashed are kept so the library reports them
+int read_list(const char* listFile)
+{
+  FILE* file = strcmp(listFile, "-") == 0 ? stdin : fopen(listFile, "r");
+  if (file == NULL) {
+    perror("can't open file list");
+    return -1;
+  }
 
-  if (leftIndex < param->numThread) {
-    strcpy(concatHash, currentHashVal); 
-    strcat(concatHash, leftHashVal);    
-    if (rightIndex < param->numThread) {
-      strcat(concatHash, rightHashVal);
+  char* line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, file)) != -1) {
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    struct stat st;
+    add_entry(line, (stat(line, &st) == 0 && S_ISREG(st.st_mode)) ? (uint64_t)st.st_size : 0);
+  }
+  free(line);
+  if (file != stdin)
+    fclose(file);
+  return 0;
+}
+
+int entry_cmp(const void* a, const void* b)
+{
+  return strcmp(((const struct entry*)a)->path, ((const struct entry*)b)->path);
+}
+
+// hash every file under dir (or named in listFile) on one shared pool, each file's hash is the
+// same as running htree on it alone. Prints a hash per file sorted by path and a manifest hash,
+// which is the block hash of those printed "hash  path" lines
+int hash_files(char* dir, char* listFile, struct htreeConfig* cfg)
+{
+  int status = EXIT_SUCCESS;
+
+  if (listFile != NULL) {
+    if (read_list(listFile) != 0)
+      return EXIT_FAILURE;
+  }
+  else if (nftw(dir, walk_entry, 64, FTW_PHYS) != 0) {
+    perror("can't walk directory");
+    return EXIT_FAILURE;
+  }
+  qsort(entries, numEntries, sizeof(struct entry), entry_cmp);
+
+  uint64_t totalBytes = 0;
+  char** paths = malloc((numEntries + 1) * sizeof(char*));
+  uint64_t* hashes = malloc((numEntries + 1) * sizeof(uint64_t));
+  int* errs = malloc((numEntries + 1) * sizeof(int));
+  for (uint i = 0; i < numEntries; i++) {
+    totalBytes += entries[i].size;
+    paths[i] = entries[i].path;
+  }
+  printf("Files: %u (%" PRIu64 " bytes) \n", numEntries, totalBytes);
+  printf("Worker threads: %u \n", cfg->numWorkers);
+  print_kernel(cfg->hashKind);
+
+  struct htree* ctx = htree_create(cfg);
+  if (ctx == NULL) {
+    perror("can't start workers");
+    return EXIT_FAILURE;
+  }
+  uint numCpus, numNodes;
+  int hugeErr;
+  htree_placement(ctx, &numCpus, &numNodes, &hugeErr);
+  if (cfg->pin)
+    printf("Pinned to %u cpus on %u NUMA nodes \n", numCpus, numNodes);
+
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  double start = GetTime();
+
+  htree_hash_files(ctx, paths, numEntries, hashes, errs);
+
+  // per file lines make up the manifest, files that failed are left out of it
+  char* manifest = NULL;
+  size_t manifestLen = 0;
+  FILE* out = open_memstream(&manifest, &manifestLen);
+  for (uint i = 0; i < numEntries; i++) {
+    if (errs[i] != 0) {
+      fprintf(stderr, "%s: %s \n", paths[i], strerror(errs[i]));
+      status = EXIT_FAILURE;
+      continue;
     }
-    hashValue = jenkins_one_at_a_time_hash((uint8_t*)concatHash, strlen(concatHash));
+    fprintf(out, "%" PRIu64 "  %s\n", hashes[i], paths[i]);
   }
+  fclose(out);
+  uint64_t hash = htree_hash_block(cfg->hashKind, manifest, manifestLen);
+
+  double end = GetTime();
+  getrusage(RUSAGE_SELF, &after);
+  fputs(manifest, stdout);
+  printf("manifest hash = %" PRIu64 " \n", hash);
+  printf("time taken = %f \n", (end - start));
+  printf("Page faults: %ld minor, %ld major \n", after.ru_minflt - before.ru_minflt, after.ru_majflt - before.ru_majflt);
+  if (walkErrors > 0)
+    status = EXIT_FAILURE;
 
-  return (void*)(uintptr_t)hashValue;
+  free(manifest);
+  for (uint i = 0; i < numEntries; i++)
+    free(entries[i].path);
+  free(entries);
+  free(paths);
+  free(hashes);
+  free(errs);
+  htree_destroy(ctx);
+  return status;
 }
 
-// hash function
-uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, uint64_t length) 
+// htree prove: prints the inclusion proof of one block. The leaves of the tree are whole chunks,
+// so the proof is for the chunk holding the block, which is just that block when num_threads
+// is the number of blocks. With -m the tree comes out of the sidecar when the file is unchanged
+int prove(int argc, char** argv)
 {
-  uint64_t i = 0;
-  uint32_t hash = 0;
+  int opt;
+  struct htreeConfig cfg;
+  char* sidecar = NULL;
+  int badOpt = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.blockSize = HTREE_BSIZE;
+  while ((opt = getopt(argc, argv, "w:H:b:m:")) != -1) {
+    switch (opt) {
+      case 'w':
+        cfg.numWorkers = atol(optarg) > 0 ? atol(optarg) : 0;
+        break;
+      case 'H':
+        cfg.hashKind = parse_hash(optarg);
+        if (cfg.hashKind == -1)
+          badOpt = 1;
+        break;
+      case 'b':
+        cfg.blockSize = parse_size(optarg);
+        break;
+      case 'm':
+        sidecar = optarg;
+        break;
+      default:
+        badOpt = 1;
+    }
+  }
+  if (badOpt || argc - optind != 3 || cfg.blockSize == 0 || atoi(argv[optind + 1]) < 1) {
+    fprintf(stderr, "Usage: htree prove [-w num_workers] [-H jenkins|xxh64] [-b block_size] [-m sidecar] "
+                    "filename num_threads block_index \n");
+    return EXIT_FAILURE;
+  }
+  cfg.numThread = atoi(argv[optind + 1]);
+  uint64_t block = strtoull(argv[optind + 2], NULL, 10);
 
-  while (i != length) {
-    hash += key[i++];
-    hash += hash << 10;
-    hash ^= hash >> 6;
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd == -1) {
+    perror("open failed");
+    return EXIT_FAILURE;
+  }
+  struct stat fileStat;
+  fstat(fd, &fileStat);
+  if (!S_ISREG(fileStat.st_mode)) {
+    fprintf(stderr, "%s is not a regular file \n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  // blocks past the last whole chunk aren't in the tree at all
+  uint64_t fileSize = fileStat.st_size;
+  uint64_t blocksPerNode = htree_count_blocks(fileSize, cfg.blockSize) / cfg.numThread;
+  if (blocksPerNode == 0 || block / blocksPerNode >= cfg.numThread) {
+    fprintf(stderr, "block %" PRIu64 " is not part of the hashed tree \n", block);
+    return EXIT_FAILURE;
   }
-  hash += hash << 3;
-  hash ^= hash >> 11;
-  hash += hash << 15;
-  return hash;
+  if (blocksPerNode > 1)
+    fprintf(stderr, "block %" PRIu64 " is in node %" PRIu64 ", the proof covers its %" PRIu64 " blocks \n",
+            block, block / blocksPerNode, blocksPerNode);
+
+  struct htree* ctx = htree_create(&cfg);
+  if (ctx == NULL) {
+    perror("can't start workers");
+    return EXIT_FAILURE;
+  }
+  uint8_t* mapAddr = NULL;
+  if (fileSize > 0) {
+    mapAddr = htree_map(ctx, fd, fileSize);
+    if (mapAddr == MAP_FAILED) {
+      perror("mmap failed");
+      return EXIT_FAILURE;
+    }
+  }
+
+  int rehash;
+  struct htree_tree* tree = NULL;
+  if (sidecar != NULL)
+    tree = htree_tree_load(ctx, sidecar, mapAddr, fileSize, &fileStat, NULL, 0, &rehash);
+  if (tree == NULL)
+    tree = htree_tree_build(ctx, mapAddr, fileSize);
+  if (sidecar != NULL && htree_tree_save(tree, sidecar, &fileStat) != 0) {
+    perror("sidecar write failed");
+    return EXIT_FAILURE;
+  }
+
+  htree_tree_prove(tree, block, stdout);
+
+  htree_tree_free(tree);
+  htree_destroy(ctx);
+  if (mapAddr != NULL)
+    munmap(mapAddr, fileSize);
+  close(fd);
+  return EXIT_SUCCESS;
 }
+
+// htree verify: checks a chunk against a root with a proof from htree prove. Only that chunk is
+// read, from its place in the file or, with "-", as just the chunk's bytes on stdin, and then
+// it's one hash per tree level. The root defaults to the one written in the proof
+int verify(int argc, char** argv)
+{
+  struct htreeCheck check;
+
+  if (argc < 3 || argc > 4 || (strcmp(argv[1], "-") == 0 && strcmp(argv[2], "-") == 0)) {
+    fprintf(stderr, "Usage: htree verify proof|- filename|- [root] \n");
+    return EXIT_FAILURE;
+  }
+
+  FILE* proof = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+  if (proof == NULL) {
+    perror("can't open proof");
+    return EXIT_FAILURE;
+  }
+  int fd = strcmp(argv[2], "-") == 0 ? STDIN_FILENO : open(argv[2], O_RDONLY);
+  if (fd == -1) {
+    perror("open failed");
+    return EXIT_FAILURE;
+  }
+
+  if (htree_verify(proof, fd, fd == STDIN_FILENO, &check) != 0) {
+    if (errno == EIO)
+      fprintf(stderr, "%s ends before the chunk does \n", argv[2]);
+    else
+      fprintf(stderr, "malformed proof \n");
+    return EXIT_FAILURE;
+  }
+  if (proof != stdin)
+    fclose(proof);
+  if (fd != STDIN_FILENO)
+    close(fd);
+
+  uint64_t root = check.proofRoot;
+  if (argc == 4)
+    root = strtoull(argv[3], NULL, 10);
+  else
+    printf("No root given, checking against the one in the proof \n");
+
+  printf("chunk hash = %" PRIu64 " \n", check.chunkHash);
+  printf("computed root = %" PRIu64 " \n", check.root);
+  printf("hashes computed: %u \n", check.hashes);
+  if (check.root != root) {
+    printf("proof FAILED, expected root %" PRIu64 " \n", root);
+    return EXIT_FAILURE;
+  }
+  printf("proof OK \n");
+  return EXIT_SUCCESS;
+}
+
+// a socket for "unix:/path" or "host:port", bound and listening or connected. An empty host
+// listens on every address
+int open_socket(const char* addr, int listening)
+{
+  int fd;
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(sun.sun_path, addr + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    if (listening)
+      unlink(sun.sun_path);
+    if ((listening ? bind(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1 || listen(fd, 16) == -1
+                   : connect(fd, (struct sockaddr*)&sun, sizeof(sun)) == -1)) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    return fd;
+  }
+
+  char host[256];
+  const char* port = strrchr(addr, ':');
+  if (port == NULL || (size_t)(port - addr) >= sizeof(host)) {
+    errno = EINVAL;
+    return -1;
+  }
+  memcpy(host, addr, port - addr);
+  host[port - addr] = '\0';
+
+  struct addrinfo hints, *res, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  int gaiErr = getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &res);
+  if (gaiErr != 0) {
+    fprintf(stderr, "%s: %s \n", addr, gai_strerror(gaiErr));
+    errno = EINVAL;
+    return -1;
+  }
+  fd = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd == -1)
+      continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (listening ? bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0
+                  : connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// one coordinator connection of htree serve: a header line with the tree shape and the file,
+// then "subtree N" / "chunk N" lines, each answered with the same line plus the hash
+void serve_conn(int fd, struct htreeConfig* base)
+{
+  FILE* in = fdopen(fd, "r");
+  char line[4352];
+  unsigned version;
+  int kind, pathStart;
+  unsigned long long blockSize, fileSize;
+  uint numThread;
+
+  if (fgets(line, sizeof(line), in) == NULL)
+    goto out;
+  line[strcspn(line, "\n")] = '\0';
+  if (sscanf(line, "htree %u %d %llu %u %llu %n", &version, &kind, &blockSize, &numThread, &fileSize, &pathStart) != 5
+      || version != 1 || blockSize == 0 || numThread == 0 || (kind != HTREE_JENKINS && kind != HTREE_XXH64)) {
+    dprintf(fd, "error bad header\n");
+    goto out;
+  }
+
+  // the file has to be the same one the coordinator sees, at the same path
+  char* path = line + pathStart;
+  int file = open(path, O_RDONLY);
+  struct stat st;
+  if (file == -1 || fstat(file, &st) == -1) {
+    dprintf(fd, "error %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  if ((uint64_t)st.st_size != fileSize) {
+    dprintf(fd, "error %s is %lld bytes here, not %llu\n", path, (long long)st.st_size, fileSize);
+    close(file);
+    goto out;
+  }
+
+  struct htreeConfig cfg = *base;
+  cfg.numThread = numThread;
+  cfg.blockSize = blockSize;
+  cfg.hashKind = kind;
+  struct htree* ctx = htree_create(&cfg);
+  uint8_t* mapAddr = NULL;
+  if (ctx != NULL && fileSize > 0)
+    mapAddr = htree_map(ctx, file, fileSize);
+  if (ctx == NULL || mapAddr == MAP_FAILED) {
+    dprintf(fd, "error %s\n", strerror(errno));
+    if (ctx != NULL)
+      htree_destroy(ctx);
+    close(file);
+    goto out;
+  }
+
+  // every job gets the whole pool, the coordinator keeps a couple queued so it never waits
+  char jobKind[16];
+  uint tid;
+  uint64_t hash;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (sscanf(line, "%15s %u", jobKind, &tid) != 2 || tid >= numThread
+        || (strcmp(jobKind, "subtree") != 0 && strcmp(jobKind, "chunk") != 0)) {
+      dprintf(fd, "error bad job\n");
+      break;
+    }
+    if (strcmp(jobKind, "subtree") == 0)
+      htree_hash_subtree(ctx, mapAddr, fileSize, tid, &hash);
+    else
+      htree_hash_chunk(ctx, mapAddr, fileSize, tid, &hash);
+    if (dprintf(fd, "%s %u %" PRIu64 "\n", jobKind, tid, hash) < 0)
+      break;
+  }
+
+  htree_destroy(ctx);
+  if (mapAddr != NULL)
+    munmap(mapAddr, fileSize);
+  close(file);
+out:
+  fclose(in);
+}
+
+// htree serve: a worker process for htree coord. It hashes whatever subtrees a coordinator
+// sends it, one coordinator at a time, until it's killed
+int serve(int argc, char** argv)
+{
+  int opt;
+  struct htreeConfig cfg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  while ((opt = getopt(argc, argv, "w:pa:T")) != -1) {
+    if (placement_opt(&cfg, opt, optarg) == 0)
+      continue;
+    if (opt == 'w' && atol(optarg) > 0) {
+      cfg.numWorkers = atol(optarg);
+      continue;
+    }
+    argc = 0;
+  }
+  if (argc - optind != 1) {
+    fprintf(stderr, "Usage: htree serve [-w num_workers] [-p] [-a advice] [-T] unix:path|host:port \n");
+    return EXIT_FAILURE;
+  }
+
+  // a coordinator that goes away mid-answer shouldn't take the worker with it
+  signal(SIGPIPE, SIG_IGN);
+  int lfd = open_socket(argv[optind], 1);
+  if (lfd == -1) {
+    perror("can't listen");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "serving on %s \n", argv[optind]);
+  for (;;) {
+    int fd = accept(lfd, NULL, NULL);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept failed");
+      return EXIT_FAILURE;
+    }
+    serve_conn(fd, &cfg);
+  }
+}
+
+// jobs a coordinator keeps queued on each worker
+#define COORD_WINDOW 2
+
+// a worker process as the coordinator sees it
+struct remote{
+  char* addr;
+  int fd;             // -1 once it's gone
+  char buf[256];      // a partial answer line
+  uint len;
+  uint inFlight;
+  double lastHeard;
+};
+
+// a subtree (or a lone chunk above the subtrees) and who has it
+struct job{
+  int subtree;
+  int owner;          // remote it was sent to, -1 while queued
+  int done;
+  uint64_t hash;
+};
+
+// a worker died, hung or answered nonsense: its queued jobs go back to the others
+void drop_remote(struct remote* r, uint id, struct job* jobs, uint numJobs, uint* retried, const char* why)
+{
+  uint lost = 0;
+
+  for (uint j = 0; j < numJobs; j++) {
+    if (jobs[j].owner == (int)id && !jobs[j].done) {
+      jobs[j].owner = -1;
+      lost++;
+    }
+  }
+  fprintf(stderr, "worker %s %s, retrying its %u jobs elsewhere \n", r->addr, why, lost);
+  *retried += lost;
+  close(r->fd);
+  r->fd = -1;
+  r->inFlight = 0;
+}
+
+// htree coord: hashes a file with worker processes from htree serve. The tree is cut at a depth
+// with a few subtrees per worker, each subtree root (by tid, the same numbering tree() uses) is
+// one job and so is every chunk above them. The answers are combined here into the same root a
+// single process gets. Workers have to see the file at the same absolute path
+int coord(int argc, char** argv)
+{
+  int opt;
+  struct htreeConfig cfg;
+  double timeout = 0;
+  char* addrs = NULL;
+  int badOpt = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.blockSize = HTREE_BSIZE;
+  while ((opt = getopt(argc, argv, "c:H:b:t:")) != -1) {
+    switch (opt) {
+      case 'c':
+        addrs = optarg;
+        break;
+      case 'H':
+        cfg.hashKind = parse_hash(optarg);
+        if (cfg.hashKind == -1)
+          badOpt = 1;
+        break;
+      case 'b':
+        cfg.blockSize = parse_size(optarg);
+        break;
+      case 't':
+        timeout = atof(optarg);
+        break;
+      default:
+        badOpt = 1;
+    }
+  }
+  if (badOpt || argc - optind != 2 || addrs == NULL || cfg.blockSize == 0 || atoi(argv[optind + 1]) < 1) {
+    fprintf(stderr, "Usage: htree coord -c addr,addr,... [-H jenkins|xxh64] [-b block_size] [-t timeout_secs] "
+                    "filename num_threads \n");
+    return EXIT_FAILURE;
+  }
+  cfg.numThread = atoi(argv[optind + 1]);
+  uint n = cfg.numThread;
+
+  char path[4096];
+  struct stat st;
+  if (realpath(argv[optind], path) == NULL || stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "%s is not a regular file \n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  // connect to every worker and tell it what we are hashing
+  signal(SIGPIPE, SIG_IGN);
+  struct remote* remotes = calloc(strlen(addrs) + 1, sizeof(struct remote));
+  uint numRemotes = 0, numAlive = 0;
+  for (char* a = strtok(addrs, ","); a != NULL; a = strtok(NULL, ",")) {
+    struct remote* r = &remotes[numRemotes++];
+    r->addr = a;
+    r->fd = open_socket(a, 0);
+    if (r->fd == -1) {
+      fprintf(stderr, "worker %s: %s \n", a, strerror(errno));
+      continue;
+    }
+    dprintf(r->fd, "htree 1 %d %" PRIu64 " %u %lld %s\n", cfg.hashKind, cfg.blockSize, n, (long long)st.st_size, path);
+    numAlive++;
+  }
+  printf("Workers: %u of %u connected \n", numAlive, numRemotes);
+  if (numAlive == 0)
+    return EXIT_FAILURE;
+
+  // cut depth: about four subtrees per worker so a slow or dead one is only a small share. Job
+  // j is node j, the nodes above the cut are chunk jobs and the ones on it subtree jobs
+  uint depth = 0;
+  while (depth < 31 && (2ull << depth) - 1 < n && (1u << depth) < 4 * numAlive)
+    depth++;
+  uint firstRoot = (1u << depth) - 1;
+  uint numJobs = (2ull << depth) - 1 < n ? (2u << depth) - 1 : n;
+  struct job* jobs = calloc(numJobs, sizeof(struct job));
+  for (uint j = 0; j < numJobs; j++) {
+    jobs[j].subtree = (j >= firstRoot);
+    jobs[j].owner = -1;
+  }
+  printf("Jobs: %u subtrees and %u chunks above them \n", numJobs - firstRoot, firstRoot);
+
+  double start = GetTime();
+  uint numDone = 0, retried = 0, next = 0;
+  struct pollfd* fds = malloc(numRemotes * sizeof(struct pollfd));
+  while (numDone < numJobs) {
+    // top everyone up to the window, queued jobs are always handed out lowest tid first
+    for (uint i = 0; i < numRemotes; i++) {
+      struct remote* r = &remotes[i];
+      while (r->fd != -1 && r->inFlight < COORD_WINDOW) {
+        while (next < numJobs && (jobs[next].done || jobs[next].owner != -1))
+          next++;
+        if (next == numJobs)
+          break;
+        if (r->inFlight == 0)
+          r->lastHeard = GetTime();
+        jobs[next].owner = i;
+        r->inFlight++;
+        if (dprintf(r->fd, "%s %u\n", jobs[next].subtree ? "subtree" : "chunk", next) < 0) {
+          drop_remote(r, i, jobs, numJobs, &retried, "went away");
+          numAlive--;
+          next = 0;
+        }
+      }
+    }
+    if (numAlive == 0) {
+      fprintf(stderr, "no workers left, %u of %u jobs done \n", numDone, numJobs);
+      return EXIT_FAILURE;
+    }
+
+    for (uint i = 0; i < numRemotes; i++) {
+      fds[i].fd = remotes[i].fd;
+      fds[i].events = POLLIN;
+    }
+    if (poll(fds, numRemotes, timeout > 0 ? 200 : -1) == -1 && errno != EINTR) {
+      perror("poll failed");
+      return EXIT_FAILURE;
+    }
+
+    for (uint i = 0; i < numRemotes; i++) {
+      struct remote* r = &remotes[i];
+      if (r->fd == -1)
+        continue;
+      if (fds[i].revents == 0) {
+        if (timeout > 0 && r->inFlight > 0 && GetTime() - r->lastHeard > timeout) {
+          drop_remote(r, i, jobs, numJobs, &retried, "timed out");
+          numAlive--;
+          next = 0;
+        }
+        continue;
+      }
+
+      ssize_t got = read(r->fd, r->buf + r->len, sizeof(r->buf) - 1 - r->len);
+      if (got <= 0) {
+        drop_remote(r, i, jobs, numJobs, &retried, "went away");
+        numAlive--;
+        next = 0;
+        continue;
+      }
+      r->len += got;
+      r->buf[r->len] = '\0';
+      r->lastHeard = GetTime();
+
+      // take every whole line, keep the rest for the next read
+      char* line = r->buf;
+      char* end;
+      while (r->fd != -1 && (end = strchr(line, '\n')) != NULL) {
+        char jobKind[16];
+        uint tid;
+        uint64_t hash;
+        *end = '\0';
+        if (sscanf(line, "%15s %u %" SCNu64, jobKind, &tid, &hash) != 3 || tid >= numJobs
+            || jobs[tid].owner != (int)i || jobs[tid].done
+            || strcmp(jobKind, jobs[tid].subtree ? "subtree" : "chunk") != 0) {
+          fprintf(stderr, "worker %s: %s \n", r->addr, line);
+          drop_remote(r, i, jobs, numJobs, &retried, "failed");
+          numAlive--;
+          next = 0;
+          break;
+        }
+        jobs[tid].hash = hash;
+        jobs[tid].done = 1;
+        r->inFlight--;
+        numDone++;
+        line = end + 1;
+      }
+      if (r->fd != -1) {
+        r->len = strlen(line);
+        memmove(r->buf, line, r->len + 1);
+        if (r->len == sizeof(r->buf) - 1) {
+          drop_remote(r, i, jobs, numJobs, &retried, "sent garbage");
+          numAlive--;
+          next = 0;
+        }
+      }
+    }
+  }
+
+  // the part of the tree above the cut, bottom up like tree()
+  uint64_t* nodeHash = malloc(numJobs * sizeof(uint64_t));
+  for (uint t = numJobs; t > 0; t--) {
+    uint tid = t - 1;
+    uint left = 2 * tid + 1;
+    uint numKids = (left < n) + (left + 1 < n);
+    if (jobs[tid].subtree)
+      nodeHash[tid] = jobs[tid].hash;
+    else
+      nodeHash[tid] = htree_combine(cfg.hashKind, jobs[tid].hash, numKids ? nodeHash + left : NULL, numKids);
+  }
+  double end = GetTime();
+
+  printf("hash value = %" PRIu64 " \n", nodeHash[0]);
+  printf("time taken = %f \n", (end - start));
+  printf("Jobs retried: %u \n", retried);
+  for (uint i = 0; i < numRemotes; i++) {
+    if (remotes[i].fd != -1)
+      close(remotes[i].fd);
+  }
+  free(nodeHash);
+  free(fds);
+  free(jobs);
+  free(remotes);
+  return EXIT_SUCCESS;
+}
+
+// htree bench: sweeps worker counts, tree sizes, block sizes and file sizes and prints one CSV
+// line per combination, once with the file in the page cache (warm) and once with it dropped
+// (cold). Cold runs use POSIX_FADV_DONTNEED, which only drops clean pages of files nobody
+// else has mapped, so it needs no root
+int bench(int argc, char** argv)
+{
+  uint64_t workers[64], threads[64], blocks[64], sizes[64];
+  uint numWorkerCounts = 1, numThreadCounts = 1, numBlockSizes = 1, numSizes = 1;
+  int reps = 5;
+  struct htreeConfig cfg;
+  const char* dir = "/tmp";
+  int opt;
+  int badOpt = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  workers[0] = sysconf(_SC_NPROCESSORS_ONLN);
+  threads[0] = 64;
+  blocks[0] = HTREE_BSIZE;
+  sizes[0] = 256 << 20;
+
+  while ((opt = getopt(argc, argv, "w:t:b:f:r:d:H:pa:T")) != -1) {
+    if (placement_opt(&cfg, opt, optarg) == 0)
+      continue;
+    switch (opt) {
+      case 'w':
+        numWorkerCounts = parse_list(optarg, workers, 64);
+        break;
+      case 't':
+        numThreadCounts = parse_list(optarg, threads, 64);
+        break;
+      case 'b':
+        numBlockSizes = parse_list(optarg, blocks, 64);
+        break;
+      case 'f':
+        numSizes = parse_list(optarg, sizes, 64);
+        break;
+      case 'r':
+        reps = atoi(optarg);
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'H':
+        cfg.hashKind = parse_hash(optarg);
+        if (cfg.hashKind == -1)
+          badOpt = 1;
+        break;
+      default:
+        badOpt = 1;
+    }
+  }
+  if (badOpt || numWorkerCounts == 0 || numThreadCounts == 0 || numBlockSizes == 0 || numSizes == 0 || reps < 1) {
+    fprintf(stderr, "Usage: htree bench [-w workers,...] [-t num_threads,...] [-b block_size,...] "
+                    "[-f file_size,...] [-r reps] [-d tmp_dir] [-H jenkins|xxh64] [-p] [-a advice] [-T] \n");
+    return EXIT_FAILURE;
+  }
+
+  uint lanes;
+  const char* kernel = htree_kernel(&lanes);
+  // hashed_bytes is what the tree actually covers, the gbps columns are over those bytes
+  printf("hash,kernel,file_bytes,hashed_bytes,block_size,num_threads,workers,cache,reps,mean_gbps,var_gbps,min_gbps,max_gbps\n");
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/htree-bench.%d", dir, (int)getpid());
+
+  for (uint f = 0; f < numSizes; f++) {
+    int fd = make_bench_file(path, sizes[f]);
+    if (fd == -1)
+      return EXIT_FAILURE;
+
+    for (uint w = 0; w < numWorkerCounts; w++) {
+      for (uint b = 0; b < numBlockSizes; b++) {
+        for (uint t = 0; t < numThreadCounts; t++) {
+          // a context per tree shape, its workers are started outside the timed runs
+          cfg.numWorkers = workers[w];
+          cfg.numThread = threads[t];
+          cfg.blockSize = blocks[b];
+          struct htree* ctx = htree_create(&cfg);
+          if (ctx == NULL) {
+            perror("can't start workers");
+            return EXIT_FAILURE;
+          }
+
+          // bytes of the file the tree reads, blocks past numThread * chunk aren't hashed and the
+          // padding of a short last block isn't read. Throughput is taken over these
+          uint64_t hashed = (htree_count_blocks(sizes[f], blocks[b]) / threads[t]) * blocks[b] * threads[t];
+          if (hashed > sizes[f])
+            hashed = sizes[f];
+
+          for (int cold = 0; cold < 2; cold++) {
+            double gbps[reps];
+            double sum = 0, min = 0, max = 0;
+
+            // warm runs get one untimed pass first so every page is cached
+            if (!cold)
+              bench_run(ctx, fd, sizes[f]);
+
+            for (int r = 0; r < reps; r++) {
+              if (cold)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+              double secs = bench_run(ctx, fd, sizes[f]);
+              if (secs < 0)
+                return EXIT_FAILURE;
+              gbps[r] = hashed / secs / 1e9;
+              sum += gbps[r];
+              min = (r == 0 || gbps[r] < min) ? gbps[r] : min;
+              max = (r == 0 || gbps[r] > max) ? gbps[r] : max;
+            }
+
+            double mean = sum / reps;
+            double var = 0;
+            for (int r = 0; r < reps; r++)
+              var += (gbps[r] - mean) * (gbps[r] - mean);
+            var = (reps > 1) ? var / (reps - 1) : 0;
+
+            printf("%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%s,%d,%.4f,%.6f,%.4f,%.4f\n",
+                   cfg.hashKind == HTREE_XXH64 ? "xxh64" : "jenkins", cfg.hashKind == HTREE_XXH64 ? "scalar" : kernel,
+                   sizes[f], hashed, blocks[b], threads[t], workers[w], cold ? "cold" : "warm", reps,
+                   mean, var, min, max);
+            fflush(stdout);
+          }
+          htree_destroy(ctx);
+        }
+      }
+    }
+
+    close(fd);
+    unlink(path);
+  }
+  return EXIT_SUCCESS;
+}
+
+// shows which block hash and kernel the run uses
+void print_kernel(int hashKind)
+{
+  uint lanes;
+  const char* kernel = htree_kernel(&lanes);
+
+  if (hashKind == HTREE_XXH64)
+    printf("Block hash: xxh64 \n");
+  else
+    printf("Block hash: jenkins (%s, %u lanes) \n", kernel, lanes);
+}
+
+// which reader a direct run ended up with and why it fell back, if it did
+void print_engine(struct htree* ctx, struct htreeConfig* cfg)
+{
+  int directErr, uringErr;
+  int engine = htree_engine(ctx, &directErr, &uringErr);
+
+  if (engine == HTREE_ENGINE_URING)
+    printf("Read engine: io_uring, queue depth %u", cfg->queueDepth);
+  else
+    printf("Read engine: pread thread (io_uring: %s)", strerror(uringErr));
+  if (directErr != 0)
+    printf(", buffered with pages dropped (O_DIRECT: %s) \n", strerror(directErr));
+  else
+    printf(", O_DIRECT \n");
+}
+
+// kB of the file in the page cache, from mincore on a mapping that's never touched
+long cached_kb(int fd, uint64_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t pages = (size + page - 1) / page;
+  long count = 0;
+
+  if (size == 0)
+    return 0;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    return -1;
+  unsigned char* vec = malloc(pages);
+  if (mincore(addr, size, vec) == 0) {
+    for (uint64_t i = 0; i < pages; i++)
+      count += vec[i] & 1;
+  }
+  else {
+    count = -1;
+  }
+  free(vec);
+  munmap(addr, size);
+  return (count < 0) ? -1 : count * (page / 1024);
+}
+
+// the -p/-a/-T options shared by normal runs and bench, returns -1 for any other option
+int placement_opt(struct htreeConfig* cfg, int opt, char* arg)
+{
+  if (opt == 'p') {
+    cfg->pin = 1;
+  }
+  else if (opt == 'T') {
+    cfg->huge = 1;
+  }
+  else if (opt == 'a') {
+    if (strcmp(arg, "none") == 0)
+      cfg->advice = HTREE_ADVISE_NONE;
+    else if (strcmp(arg, "seq") == 0)
+      cfg->advice = HTREE_ADVISE_SEQ;
+    else if (strcmp(arg, "willneed") == 0)
+      cfg->advice = HTREE_ADVISE_WILLNEED;
+    else if (strcmp(arg, "populate") == 0)
+      cfg->advice = HTREE_ADVISE_POPULATE;
+    else
+      return -1;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+// kB of our memory currently mapped with huge pages, -1 if the kernel doesn't say
+long huge_kb()
+{
+  FILE* file = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  long total = -1, kb;
+
+  if (file == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld", &kb) == 1 || sscanf(line, "FilePmdMapped: %ld", &kb) == 1)
+      total = (total < 0 ? 0 : total) + kb;
+  }
+  fclose(file);
+  return total;
+}
+
 // tells user the appropriate arguments for the program
-void Usage(char* s) 
+void Usage(char* s)
 {
-  fprintf(stderr, "Usage: %s filename num_threads \n", s);
+  fprintf(stderr, "Usage: %s [-w num_workers] [-s] [-n size] [-H jenkins|xxh64] [-m sidecar [-D off:len,...]] "
+                  "[-b block_size] [-p] [-a none|seq|willneed|populate] [-T] [-o [-q depth] [-C]] filename|- num_threads \n", s);
+  fprintf(stderr, "       %s [-w num_workers] [-H jenkins|xxh64] [-b block_size] directory num_threads \n", s);
+  fprintf(stderr, "       %s [-w num_workers] [-H jenkins|xxh64] [-b block_size] -l file_list|- num_threads \n", s);
+  fprintf(stderr, "       %s bench [-w workers,...] [-t num_threads,...] [-b block_size,...] [-f file_size,...] "
+                  "[-r reps] [-d tmp_dir] [-H jenkins|xxh64] [-p] [-a advice] [-T] \n", s);
+  fprintf(stderr, "       %s prove [-w num_workers] [-H jenkins|xxh64] [-b block_size] [-m sidecar] "
+                  "filename num_threads block_index \n", s);
+  fprintf(stderr, "       %s verify proof|- filename|- [root] \n", s);
+  fprintf(stderr, "       %s coord -c addr,addr,... [-H jenkins|xxh64] [-b block_size] [-t timeout_secs] "
+                  "filename num_threads \n", s);
+  fprintf(stderr, "       %s serve [-w num_workers] [-p] [-a advice] [-T] unix:path|host:port \n", s);
   exit(EXIT_FAILURE);
 }
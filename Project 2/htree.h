@@ -0,0 +1,117 @@
+// htree as a library: a context owns a worker pool that stays up between calls, so hashing
+// lots of buffers in one process doesn't start threads every time. Calls on one context may
+// come from several threads at once, but a tree from htree_tree_build or htree_tree_load is
+// used by one thread at a time.
+#ifndef HTREE_H
+#define HTREE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// default block size
+#define HTREE_BSIZE 4096
+
+// block hashes, jenkins is the original one and stays the default
+#define HTREE_JENKINS 0
+#define HTREE_XXH64 1
+
+// how mapped files get their pages
+#define HTREE_ADVISE_NONE 0       // faulted in by whichever thread touches them first
+#define HTREE_ADVISE_SEQ 1        // MADV_SEQUENTIAL on the whole mapping for bigger readahead
+#define HTREE_ADVISE_WILLNEED 2   // every leaf task asks for its own chunks before hashing them
+#define HTREE_ADVISE_POPULATE 3   // MAP_POPULATE, read and mapped up front
+
+// how htree_hash_fd got a file's bytes
+#define HTREE_ENGINE_MMAP 0
+#define HTREE_ENGINE_READ 1       // a reader thread with two big buffers (streaming)
+#define HTREE_ENGINE_URING 2      // io_uring reads, queueDepth of them in flight (direct)
+#define HTREE_ENGINE_PREAD 3      // the reader thread with pread, when io_uring isn't allowed (direct)
+
+// settings of a context, fields left at 0 get the defaults
+struct htreeConfig{
+  uint numWorkers;      // worker threads, 0 for one per online cpu
+  uint numThread;       // tree nodes, the old num_threads, 0 for 1
+  uint64_t blockSize;   // chunks are whole blocks, 0 for HTREE_BSIZE
+  int hashKind;
+  int streaming;        // read fds front to back instead of mapping them
+  int pin;              // pin worker i to the i-th allowed cpu, cpus ordered by NUMA node
+  int advice;
+  int huge;             // ask for transparent huge pages on mappings and stream buffers
+  int direct;           // read regular files with O_DIRECT through io_uring, past the page cache
+  uint queueDepth;      // reads in flight in direct mode, 0 for 8
+};
+
+// what htree_verify worked out from a proof
+struct htreeCheck{
+  uint64_t chunkHash;
+  uint64_t root;        // root computed from the chunk and the proof
+  uint64_t proofRoot;   // root written in the proof
+  uint hashes;          // hash calls it took
+};
+
+// a whole hash tree kept between calls for incremental updates and proofs
+struct htree_tree;
+
+struct htree* htree_create(const struct htreeConfig*);
+void htree_destroy(struct htree*);
+
+// name of the jenkins kernel in use and its number of lanes
+const char* htree_kernel(uint*);
+// how the workers got placed: cpus and NUMA nodes they are pinned to (0 without pinning), and
+// the errno of a refused huge page request (0 if none was refused)
+void htree_placement(struct htree*, uint*, uint*, int*);
+
+// the engine the last htree_hash_fd used (any one of them when several ran at once), and in
+// direct mode why O_DIRECT (the filesystem refused it, pages are then dropped after hashing
+// instead) or io_uring fell back, 0 if not
+int htree_engine(struct htree*, int*, int*);
+
+// one shot hashes, each returns 0 and the root, or -1 with errno set
+int htree_hash_buffer(struct htree*, const void*, uint64_t, uint64_t*);
+int htree_hash_iovec(struct htree*, const struct iovec*, int, uint64_t*);
+int htree_hash_fd(struct htree*, int, int64_t, uint64_t*);
+// hash count files by path, each the same as htree_hash_fd on it alone. Small files are one
+// task each, big ones are split up. hashes[i] is set where errs[i] comes back 0
+void htree_hash_files(struct htree*, char* const*, uint, uint64_t*, int*);
+// number of blocks in size bytes, the last one may be partial
+uint64_t htree_count_blocks(uint64_t, uint64_t);
+// plain block hash of a buffer, not a tree
+uint64_t htree_hash_block(int, const void*, uint64_t);
+
+// pieces of one tree so it can be spread over processes: the subtree hash of a node, the hash
+// of just its own chunk, and the combine that makes a node's subtree hash from its chunk hash and
+// its children's subtree hashes (left first). Only the chunks a call needs are read
+int htree_hash_subtree(struct htree*, const void*, uint64_t, uint, uint64_t*);
+int htree_hash_chunk(struct htree*, const void*, uint64_t, uint, uint64_t*);
+uint64_t htree_combine(int, uint64_t, const uint64_t*, uint);
+
+// map a file for hashing with the context's advice and huge page settings
+void* htree_map(struct htree*, int, uint64_t);
+
+// trees over a buffer the caller keeps alive (a mapped file, say). build hashes everything;
+// update rehashes only the chunks under the changed byte ranges (off, len pairs), all of them
+// if the length changed, and returns how many it did. The buffer may have moved
+struct htree_tree* htree_tree_build(struct htree*, const void*, uint64_t);
+int htree_tree_update(struct htree*, struct htree_tree*, const void*, uint64_t, const uint64_t*, uint);
+uint64_t htree_tree_root(const struct htree_tree*);
+void htree_tree_free(struct htree_tree*);
+
+// sidecar files keep a tree on disk between runs. load reuses a sidecar made for this data
+// (st says whether the file changed since) and rehashes what changed, *rehashed says how many
+// chunks that was. Returns NULL with errno ENOENT if there is no sidecar, EINVAL if it's for
+// another file size, tree shape or hash, or truncated
+struct htree_tree* htree_tree_load(struct htree*, const char*, const void*, uint64_t, const struct stat*,
+                                   const uint64_t*, uint, int*);
+int htree_tree_save(const struct htree_tree*, const char*, const struct stat*);
+
+// inclusion proofs. prove writes the proof of the chunk holding a block and returns its node,
+// -1 with ERANGE if the block isn't in the tree. verify reads a proof and the chunk, from its
+// place in the fd or, with chunkOnly, as just the chunk's bytes, and works out the root.
+// Returns -1 with EINVAL for a malformed proof or EIO if the data ends early
+int htree_tree_prove(const struct htree_tree*, uint64_t, FILE*);
+int htree_verify(FILE*, int, int, struct htreeCheck*);
+
+#endif
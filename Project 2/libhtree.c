@@ -0,0 +1,2169 @@
+#define _GNU_SOURCE    // for MAP_POPULATE and pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "htree.h"
+
+// Hash function
+static uint32_t jenkins_one_at_a_time_hash(const uint8_t* , uint64_t );
+static uint32_t jenkins_update(uint32_t, const uint8_t*, uint64_t);
+static uint32_t jenkins_final(uint32_t);
+static void jenkins_lanes(uint32_t*, const uint8_t* const*, uint64_t, uint);
+static void hash_dispatch();
+static uint hash_lanes();
+
+// running state of either block hash, jenkins only uses v[0]
+struct hashState{
+  uint64_t v[4];
+  uint64_t total;
+  uint8_t mem[32];
+  uint32_t memSize;
+};
+
+static void hash_init(int, struct hashState*);
+static void hash_update(int, struct hashState*, const uint8_t*, uint64_t);
+static uint64_t hash_final(int, struct hashState*);
+static uint64_t hash_block(int, const uint8_t*, uint64_t);
+
+// kinds of work the pool runs for a tree node
+#define TASK_LEAF 1     // hash the node's own chunk
+#define TASK_COMBINE 2  // rehash the node with its children's hashes
+#define TASK_PIECE 3    // feed part of a node's chunk into its running hash (streaming mode)
+#define TASK_FILE 4     // hash a whole small file, tree and all, in one go (multi-file mode)
+
+// files below this size are hashed by a single task in htree_hash_files
+#define SMALL_FILE (4 << 20)
+// buffers below this size are hashed right on the calling thread, the pool isn't worth it
+#define INLINE_BUF (64 << 10)
+
+// where workers run and how memory is set up, the same for every tree of a context
+struct placement{
+  int pin;        // pin worker i to the i-th allowed cpu, cpus ordered by NUMA node
+  int advice;
+  int huge;       // ask for transparent huge pages on mappings and stream buffers
+  int hugeErr;    // errno of the first MADV_HUGEPAGE the kernel turned down, set atomically
+};
+
+// read size of each of the two streaming buffers
+#define STREAM_BUF (8 << 20)
+
+// direct mode reads DIRECT_BUF at a time into buffers aligned for O_DIRECT
+#define DIRECT_BUF (1 << 20)
+#define DIRECT_ALIGN 4096
+#define DIRECT_DEPTH 8
+
+// how stream_file reads
+#define STREAM_DIRECT 1   // pread whole aligned blocks, the fd has O_DIRECT
+#define STREAM_DROP 2     // drop the pages of every buffer from the page cache once it's hashed
+
+struct task{
+  int kind;
+  uint tid;
+  uint count;           // TASK_LEAF/TASK_PIECE cover nodes tid .. tid+count-1, hashed side by side
+  struct htree_tree* param;  // the tree the node belongs to
+  const uint8_t* data;  // TASK_PIECE only, the node's pieces are chunkSize apart
+  uint64_t len;
+};
+
+// per-worker deque, the owner pushes/pops at the bottom and idle workers steal from the top
+struct deque{
+  pthread_mutex_t lock;
+  struct task* items;
+  uint cap;
+  uint top;
+  uint bottom;
+};
+
+// a fixed set of worker threads that run tree node tasks, tasks of several trees can be mixed
+struct pool{
+  uint numWorkers;
+  pthread_t* workers;
+  struct deque* queues;
+  pthread_mutex_t lock;   // guards sleeping on wake
+  pthread_cond_t wake;
+  uint queued;            // tasks sitting in any deque
+  int shutdown;
+  struct placement* place;
+  int* cpus;              // cpus to pin workers to, grouped by NUMA node
+  uint numCpus;
+  uint numNodes;
+};
+
+// one hash tree being computed, nodes are numbered heap style (children of tid are 2tid+1, 2tid+2)
+struct htree_tree{
+  uint numThread;
+  uint64_t blockSize;
+  uint64_t chunkSize;
+  uint8_t* mapAddr;
+  uint64_t fileSize;
+  int hashKind;
+  uint64_t* chunkHash;    // hash of each node's own chunk
+  uint64_t* nodeHash;     // hash of each node's whole subtree
+  struct hashState* chunkState; // running chunk hashes while streaming
+  uint8_t* dirty;         // chunks that need rehashing, NULL for all of them
+  uint* remaining;        // chunk + children still to finish before a node can combine
+  int chunksDone;         // chunkHash was already filled in by the streaming reader
+  uint piecesLeft;        // streaming pieces of the current buffer not hashed yet
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int finished;
+};
+
+// one of the two buffers the reader thread fills while the other is being hashed
+struct streamBuf{
+  uint8_t* data;
+  uint64_t off;     // where in the input this buffer starts
+  uint64_t len;
+  int full;
+};
+
+// the reader thread's side of streaming mode
+struct reader{
+  int fd;
+  int flags;
+  uint64_t size;    // bytes to read in total
+  struct streamBuf bufs[2];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int finished;     // no more buffers are coming
+  int err;          // errno of a failed read, or -1 for input shorter than size
+};
+
+// what a sidecar file starts with, followed by chunkHash[numThread] and nodeHash[numThread].
+// The size, inode and mtime tell a later run whether the file changed since
+#define SIDECAR_MAGIC "HTREESC2"
+struct sidecarHeader{
+  char magic[8];
+  uint64_t blockSize;   // 64 bits since -b takes any size, version 1 files had 32
+  uint32_t numThread;
+  uint32_t hashKind;
+  uint64_t fileSize;
+  uint64_t ino;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t root;
+};
+
+// counts the small file tasks of a multi-file run that are still out
+struct batch{
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  uint pending;
+};
+
+// one file of a multi-file run, param has to stay first so a TASK_FILE can find the rest
+struct fileJob{
+  struct htree_tree param;
+  char* path;
+  uint64_t size;
+  uint64_t hash;
+  int err;              // errno if the file couldn't be hashed
+  int fd;
+  struct batch* batch;
+};
+
+// what every worker thread gets
+struct workerParam{
+  struct pool* pool;
+  uint id;
+};
+
+// a context: the settings it was made with and its pool
+struct htree{
+  struct htreeConfig cfg;
+  struct placement place;
+  struct pool* pool;
+  pthread_mutex_t lock;   // guards the three below, hash calls can run side by side
+  int engine;       // what the last htree_hash_fd read with
+  int directErr;    // why it couldn't open O_DIRECT
+  int uringErr;     // why it couldn't set up io_uring
+};
+
+static struct pool* pool_create(uint, struct placement*);
+static void pool_destroy(struct pool*);
+static void pool_push(struct pool*, uint, struct task);
+static void* worker(void*);
+static void tree_setup(struct htree_tree*);
+static uint64_t tree(struct pool*, struct htree_tree*);
+static void tree_start(struct pool*, struct htree_tree*);
+static uint64_t tree_wait(struct htree_tree*);
+static void tree_free(struct htree_tree*);
+static void run_task(struct pool*, uint, struct task);
+static void* read_input(void*);
+static int stream_file(struct pool*, struct htree_tree*, int, int);
+static uint8_t* map_file(struct placement*, int, uint64_t);
+static void huge_refused(struct placement*);
+
+// NUMA node of a cpu, from the nodeN link in its sysfs directory, 0 if there is none
+static int cpu_node(int cpu)
+{
+  char path[64];
+  int node = 0;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+      node = atoi(ent->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+// the cpus we are allowed on, ordered by node so that neighbouring workers, which start on
+// neighbouring parts of the file, end up on the same node
+static void cpu_order(struct pool* pool)
+{
+  cpu_set_t set;
+  uint64_t* keys = malloc(CPU_SETSIZE * sizeof(uint64_t));
+
+  sched_getaffinity(0, sizeof(set), &set);
+  pool->numCpus = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set))
+      keys[pool->numCpus++] = ((uint64_t)cpu_node(cpu) << 32) | cpu;
+  }
+  // insertion sort, it's a few hundred cpus at most
+  for (uint i = 1; i < pool->numCpus; i++) {
+    uint64_t k = keys[i];
+    uint j = i;
+    for (; j > 0 && keys[j - 1] > k; j--)
+      keys[j] = keys[j - 1];
+    keys[j] = k;
+  }
+  pool->cpus = malloc(pool->numCpus * sizeof(int));
+  pool->numNodes = 0;
+  for (uint i = 0; i < pool->numCpus; i++) {
+    pool->cpus[i] = (int)(keys[i] & 0xffffffff);
+    if (i == 0 || (keys[i] >> 32) != (keys[i - 1] >> 32))
+      pool->numNodes++;
+  }
+  free(keys);
+}
+
+// start the workers, each with an empty deque
+static struct pool* pool_create(uint numWorkers, struct placement* place)
+{
+  struct pool* pool = calloc(1, sizeof(struct pool));
+  pool->numWorkers = numWorkers;
+  pool->workers = malloc(numWorkers * sizeof(pthread_t));
+  pool->queues = calloc(numWorkers, sizeof(struct deque));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pool->place = place;
+  if (place->pin)
+    cpu_order(pool);
+
+  for (uint i = 0; i < numWorkers; i++) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pool->queues[i].cap = 64;
+    pool->queues[i].items = malloc(pool->queues[i].cap * sizeof(struct task));
+  }
+
+  for (uint i = 0; i < numWorkers; i++) {
+    struct workerParam* wp = malloc(sizeof(struct workerParam));
+    wp->pool = pool;
+    wp->id = i;
+    if (pthread_create(&pool->workers[i], NULL, worker, wp) != 0) {
+      // shut down the ones that did start
+      int err = errno;
+      free(wp);
+      pool->numWorkers = i;
+      pool_destroy(pool);
+      errno = err;
+      return NULL;
+    }
+  }
+  return pool;
+}
+
+// wake everyone up, let them exit and free the pool
+static void pool_destroy(struct pool* pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  // everyone has to be gone before any deque goes away, a late thief could still be looking at it
+  for (uint i = 0; i < pool->numWorkers; i++)
+    pthread_join(pool->workers[i], NULL);
+
+  for (uint i = 0; i < pool->numWorkers; i++) {
+    pthread_mutex_destroy(&pool->queues[i].lock);
+    free(pool->queues[i].items);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  free(pool->queues);
+  free(pool->workers);
+  free(pool->cpus);
+  free(pool);
+}
+
+// push a task on the bottom of worker id's deque and wake a sleeper to come steal it
+static void pool_push(struct pool* pool, uint id, struct task t)
+{
+  struct deque* q = &pool->queues[id];
+
+  pthread_mutex_lock(&q->lock);
+  // slide the live part down or grow when we hit the end
+  if (q->bottom == q->cap) {
+    if (q->top > 0) {
+      memmove(q->items, q->items + q->top, (q->bottom - q->top) * sizeof(struct task));
+      q->bottom -= q->top;
+      q->top = 0;
+    }
+    if (q->bottom == q->cap) {
+      q->cap *= 2;
+      q->items = realloc(q->items, q->cap * sizeof(struct task));
+    }
+  }
+  q->items[q->bottom++] = t;
+  pthread_mutex_unlock(&q->lock);
+
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// take from our own bottom first (newest, still warm in cache), otherwise steal the
+// oldest task from someone else's top
+static int pool_take(struct pool* pool, uint id, struct task* t)
+{
+  struct deque* q = &pool->queues[id];
+  int found = 0;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom > q->top) {
+    *t = q->items[--q->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  for (uint i = 1; !found && i < pool->numWorkers; i++) {
+    struct deque* victim = &pool->queues[(id + i) % pool->numWorkers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->bottom > victim->top) {
+      *t = victim->items[victim->top++];
+      found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  if (found)
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  return found;
+}
+
+// the worker thread, runs tasks until the pool shuts down
+static void* worker(void* arg)
+{
+  struct workerParam* wp = (struct workerParam*) arg;
+  struct pool* pool = wp->pool;
+  uint id = wp->id;
+  free(wp);
+
+  // when pinning every worker stays on its own cpu, more workers than cpus wrap around
+  if (pool->numCpus > 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pool->cpus[id % pool->numCpus], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  while (1) {
+    struct task t;
+    if (pool_take(pool, id, &t)) {
+      run_task(pool, id, t);
+      continue;
+    }
+
+    // nothing to do anywhere, sleep until a push or shutdown
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->shutdown)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    int stop = pool->shutdown;
+    pthread_mutex_unlock(&pool->lock);
+    if (stop)
+      return NULL;
+  }
+}
+
+// feed len zero bytes into a running hash
+static void hash_zeros(int kind, struct hashState* state, uint64_t len)
+{
+  static const uint8_t zeros[HTREE_BSIZE];
+
+  while (len > 0) {
+    uint64_t n = len < HTREE_BSIZE ? len : HTREE_BSIZE;
+    hash_update(kind, state, zeros, n);
+    len -= n;
+  }
+}
+
+// hash len bytes of the file starting at off, anything past the end of the file counts as zeros
+static uint64_t hash_range(struct htree_tree* param, uint64_t off, uint64_t len)
+{
+  struct hashState state;
+  uint64_t avail = 0;
+
+  if (off < param->fileSize)
+    avail = (param->fileSize - off < len) ? param->fileSize - off : len;
+  hash_init(param->hashKind, &state);
+  hash_update(param->hashKind, &state, param->mapAddr + off, avail);
+  hash_zeros(param->hashKind, &state, len - avail);
+  return hash_final(param->hashKind, &state);
+}
+
+// hash the chunks of count neighbouring nodes, with jenkins they go through the lanes kernel
+// together as long as none of them runs past the end of the file
+static void hash_leaves(struct htree_tree* param, uint tid, uint count)
+{
+  uint64_t size = param->chunkSize;
+
+  if (param->hashKind == HTREE_JENKINS && count > 1 && (tid + count) * size <= param->fileSize) {
+    const uint8_t* keys[16];
+    uint32_t hash[16];
+    for (uint k = 0; k < count; k++) {
+      keys[k] = param->mapAddr + (tid + k) * size;
+      hash[k] = 0;
+    }
+    jenkins_lanes(hash, keys, size, count);
+    for (uint k = 0; k < count; k++)
+      param->chunkHash[tid + k] = jenkins_final(hash[k]);
+    return;
+  }
+
+  for (uint k = 0; k < count; k++)
+    param->chunkHash[tid + k] = hash_range(param, (tid + k) * size, size);
+}
+
+// the whole tree is done, wake up whoever waits in tree_wait
+static void tree_finish(struct htree_tree* param)
+{
+  pthread_mutex_lock(&param->lock);
+  param->finished = 1;
+  pthread_cond_broadcast(&param->done);
+  pthread_mutex_unlock(&param->lock);
+}
+
+// the subtree hash of a node from its own chunk hash and its children's subtree hashes (left
+// first): just the chunk hash for a leaf, otherwise the same string concatenation as the old
+// thread-per-node version so the hash doesn't change
+static uint64_t combine_hash(int kind, uint64_t own, const uint64_t* kids, uint numKids)
+{
+  char concatHash[300];
+
+  if (numKids == 0)
+    return own;
+
+  int len = sprintf(concatHash, "%" PRIu64, own);
+  for (uint k = 0; k < numKids; k++)
+    len += sprintf(concatHash + len, "%" PRIu64, kids[k]);
+  return hash_block(kind, (uint8_t*)concatHash, len);
+}
+
+static void combine_node(struct htree_tree* param, uint tid)
+{
+  uint leftIndex = 2 * tid + 1;
+  uint numKids = (leftIndex < param->numThread) + (leftIndex + 1 < param->numThread);
+
+  param->nodeHash[tid] = combine_hash(param->hashKind, param->chunkHash[tid],
+                                      numKids ? param->nodeHash + leftIndex : NULL, numKids);
+}
+
+static void node_ready(struct pool*, uint, struct htree_tree*, uint);
+
+// a node's value is final, pass that on to its parent
+static void node_done(struct pool* pool, uint id, struct htree_tree* param, uint tid)
+{
+  if (tid == 0)
+    tree_finish(param);
+  else
+    node_ready(pool, id, param, (tid - 1) / 2);
+}
+
+// one of the node's dependencies finished, once all have the node gets combined
+static void node_ready(struct pool* pool, uint id, struct htree_tree* param, uint tid)
+{
+  if (__atomic_sub_fetch(&param->remaining[tid], 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  // leaves have nothing to combine with, so skip the extra task
+  if (2 * tid + 1 >= param->numThread) {
+    combine_node(param, tid);
+    node_done(pool, id, param, tid);
+    return;
+  }
+
+  struct task t = { TASK_COMBINE, tid, 1, param, NULL, 0 };
+  pool_push(pool, id, t);
+}
+
+// hash a small tree right here instead of on the pool: every chunk, then the nodes bottom up
+static uint64_t tree_inline(struct htree_tree* param)
+{
+  uint n = param->numThread;
+  uint lanes = hash_lanes();
+
+  param->chunkHash = malloc(n * sizeof(uint64_t));
+  param->nodeHash = malloc(n * sizeof(uint64_t));
+  for (uint tid = 0; tid < n; tid += lanes)
+    hash_leaves(param, tid, (n - tid < lanes) ? n - tid : lanes);
+  for (uint tid = n; tid > 0; tid--)
+    combine_node(param, tid - 1);
+  uint64_t root = param->nodeHash[0];
+  free(param->chunkHash);
+  free(param->nodeHash);
+  param->chunkHash = NULL;
+  return root;
+}
+
+// open and hash one small file of a multi-file run without splitting it up, all on this worker
+static void hash_small_file(struct fileJob* job)
+{
+  struct htree_tree* param = &job->param;
+  uint n = param->numThread;
+  uint8_t* buf = NULL;
+
+  job->err = 0;
+  int fd = open(job->path, O_RDONLY);
+  if (fd == -1) {
+    job->err = errno;
+    return;
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  param->fileSize = st.st_size;
+  param->chunkSize = (htree_count_blocks(param->fileSize, param->blockSize) / n) * param->blockSize;
+  buf = malloc(param->fileSize + 1);
+  for (uint64_t got = 0; got < param->fileSize; ) {
+    ssize_t res = read(fd, buf + got, param->fileSize - got);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      // shrank under us, hash what is there like mmap would
+      if (res == -1)
+        job->err = errno;
+      param->fileSize = got;
+      break;
+    }
+    got += res;
+  }
+  close(fd);
+
+  if (job->err == 0) {
+    param->mapAddr = buf;
+    job->hash = tree_inline(param);
+  }
+  free(buf);
+}
+
+// MADV_WILLNEED on the chunks of count nodes starting at tid, cut to the file and pages
+static void advise_chunks(struct htree_tree* param, uint tid, uint count)
+{
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t from = (uint64_t)tid * param->chunkSize;
+  uint64_t to = (uint64_t)(tid + count) * param->chunkSize;
+
+  if (to > param->fileSize)
+    to = param->fileSize;
+  from -= from % page;
+  if (from < to)
+    madvise(param->mapAddr + from, to - from, MADV_WILLNEED);
+}
+
+// run a single node task on worker id
+static void run_task(struct pool* pool, uint id, struct task t)
+{
+  struct htree_tree* param = t.param;
+  uint tid = t.tid;
+
+  if (t.kind == TASK_LEAF) {
+    // readahead for the whole group at once, on this worker's node
+    if (pool->place->advice == HTREE_ADVISE_WILLNEED)
+      advise_chunks(param, tid, t.count);
+    hash_leaves(param, tid, t.count);
+    for (uint k = 0; k < t.count; k++)
+      node_ready(pool, id, param, tid + k);
+    return;
+  }
+
+  if (t.kind == TASK_PIECE) {
+    if (param->hashKind == HTREE_JENKINS && t.count > 1) {
+      const uint8_t* keys[16];
+      uint32_t hash[16];
+      for (uint k = 0; k < t.count; k++) {
+        keys[k] = t.data + k * param->chunkSize;
+        hash[k] = param->chunkState[tid + k].v[0];
+      }
+      jenkins_lanes(hash, keys, t.len, t.count);
+      for (uint k = 0; k < t.count; k++)
+        param->chunkState[tid + k].v[0] = hash[k];
+    }
+    else {
+      for (uint k = 0; k < t.count; k++)
+        hash_update(param->hashKind, &param->chunkState[tid + k], t.data + k * param->chunkSize, t.len);
+    }
+    if (__atomic_sub_fetch(&param->piecesLeft, 1, __ATOMIC_ACQ_REL) == 0) {
+      pthread_mutex_lock(&param->lock);
+      pthread_cond_signal(&param->done);
+      pthread_mutex_unlock(&param->lock);
+    }
+    return;
+  }
+
+  if (t.kind == TASK_FILE) {
+    struct fileJob* job = (struct fileJob*) param;
+    hash_small_file(job);
+    pthread_mutex_lock(&job->batch->lock);
+    if (--job->batch->pending == 0)
+      pthread_cond_signal(&job->batch->done);
+    pthread_mutex_unlock(&job->batch->lock);
+    return;
+  }
+
+  combine_node(param, tid);
+  node_done(pool, id, param, tid);
+}
+
+// allocate the per node arrays for a tree
+static void tree_setup(struct htree_tree* param)
+{
+  uint n = param->numThread;
+
+  param->chunkHash = calloc(n, sizeof(uint64_t));
+  param->nodeHash = calloc(n, sizeof(uint64_t));
+  param->chunkState = NULL;
+  param->remaining = malloc(n * sizeof(uint));
+  param->chunksDone = 0;
+  param->piecesLeft = 0;
+  param->finished = 0;
+  pthread_mutex_init(&param->lock, NULL);
+  pthread_cond_init(&param->done, NULL);
+}
+
+// hash the tree on the pool and return the root value
+static uint64_t tree(struct pool* pool, struct htree_tree* param)
+{
+  tree_start(pool, param);
+  return tree_wait(param);
+}
+
+// queue the tree's work on the pool without waiting for it. Every dirty chunk is a task (all of
+// them when there is no dirty list) and a node's combine is queued once its chunk and whichever
+// children had to be redone are finished, everything else keeps the value it already has
+static void tree_start(struct pool* pool, struct htree_tree* param)
+{
+  uint n = param->numThread;
+  uint lanes = hash_lanes();
+
+  if (param->chunkHash == NULL)
+    tree_setup(param);
+
+  // a node is redone when its chunk is dirty or a child was redone, children have bigger
+  // indices so one pass from the back settles every node
+  uint8_t* redo = calloc(n, 1);
+  uint numDirty = 0;
+  for (uint tid = n; tid > 0; tid--) {
+    uint t = tid - 1;
+    uint dirty = (param->dirty == NULL || param->dirty[t]);
+    numDirty += dirty;
+    uint left = (2 * t + 1 < n) && redo[2 * t + 1];
+    uint right = (2 * t + 2 < n) && redo[2 * t + 2];
+    param->remaining[t] = dirty + left + right;
+    redo[t] = (param->remaining[t] > 0);
+  }
+  param->finished = !redo[0];
+  free(redo);
+
+  // streamed chunks are already hashed, only the combines are left
+  if (param->chunksDone) {
+    for (uint tid = n; tid > 0; tid--)
+      node_ready(pool, (tid - 1) % pool->numWorkers, param, tid - 1);
+  }
+  else {
+    // dirty chunks go in groups of neighbouring nodes, as many as the hash kernel has lanes but
+    // small enough that every worker gets a group
+    uint perWorker = (numDirty + pool->numWorkers - 1) / pool->numWorkers;
+    if (perWorker < lanes)
+      lanes = perWorker > 0 ? perWorker : 1;
+    uint* groupStart = malloc(n * sizeof(uint));
+    uint* groupCount = malloc(n * sizeof(uint));
+    uint numGroups = 0;
+    for (uint tid = 0; tid < n; ) {
+      if (param->dirty != NULL && !param->dirty[tid]) {
+        tid++;
+        continue;
+      }
+      uint count = 1;
+      while (count < lanes && tid + count < n && (param->dirty == NULL || param->dirty[tid + count]))
+        count++;
+      groupStart[numGroups] = tid;
+      groupCount[numGroups++] = count;
+      tid += count;
+    }
+
+    // hand the groups out in contiguous runs so each worker starts on its own part of the file,
+    // pushed in reverse so the owner pops them front to back
+    for (uint w = 0; w < pool->numWorkers; w++) {
+      uint first = (uint64_t)numGroups * w / pool->numWorkers;
+      uint last = (uint64_t)numGroups * (w + 1) / pool->numWorkers;
+      for (uint g = last; g > first; g--) {
+        struct task t = { TASK_LEAF, groupStart[g - 1], groupCount[g - 1], param, NULL, 0 };
+        pool_push(pool, w, t);
+      }
+    }
+    free(groupStart);
+    free(groupCount);
+  }
+}
+
+// wait for a tree queued by tree_start and return its root value
+static uint64_t tree_wait(struct htree_tree* param)
+{
+  pthread_mutex_lock(&param->lock);
+  while (!param->finished)
+    pthread_cond_wait(&param->done, &param->lock);
+  pthread_mutex_unlock(&param->lock);
+
+  return param->nodeHash[0];
+}
+
+// free what tree_setup allocated once the caller is done looking at the node hashes
+static void tree_free(struct htree_tree* param)
+{
+  pthread_mutex_destroy(&param->lock);
+  pthread_cond_destroy(&param->done);
+  free(param->chunkHash);
+  free(param->nodeHash);
+  free(param->chunkState);
+  free(param->remaining);
+  free(param->dirty);
+  param->chunkHash = NULL;
+}
+
+// mark the chunks under the byte ranges (off, len pairs) dirty and return how many are.
+// Only bytes inside the chunks matter, the tail past the last chunk isn't part of the hash
+static int mark_dirty(struct htree_tree* param, const uint64_t* ranges, uint numRanges)
+{
+  uint n = param->numThread;
+  uint64_t covered = param->chunkSize * n;
+
+  if (param->dirty == NULL)
+    param->dirty = calloc(n, 1);
+  for (uint i = 0; i < numRanges; i++) {
+    uint64_t off = ranges[2 * i];
+    uint64_t len = ranges[2 * i + 1];
+    if (len == 0 || off >= covered)
+      continue;
+    uint64_t end = (off + len < covered) ? off + len : covered;
+    for (uint64_t tid = off / param->chunkSize; tid <= (end - 1) / param->chunkSize; tid++)
+      param->dirty[tid] = 1;
+  }
+
+  int count = 0;
+  for (uint tid = 0; tid < n; tid++)
+    count += param->dirty[tid];
+  return count;
+}
+
+// read back the tree a previous run left in the sidecar. Returns how many chunks have to be
+// rehashed: none if the file is untouched, the ones overlapping the given byte ranges, or all
+// of them if the file changed and no ranges were given. Returns -1 with errno ENOENT when the
+// sidecar is missing, EINVAL when it was made for a different file size, tree shape or hash
+static int sidecar_load(const char* path, struct htree_tree* param, const struct stat* st, const uint64_t* ranges, uint numRanges)
+{
+  struct sidecarHeader header;
+  uint n = param->numThread;
+
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SIDECAR_MAGIC, 8) != 0
+      || header.blockSize != param->blockSize || header.numThread != n || header.hashKind != (uint32_t)param->hashKind
+      || header.fileSize != param->fileSize) {
+    fclose(file);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tree_setup(param);
+  if (fread(param->chunkHash, sizeof(uint64_t), n, file) != n
+      || fread(param->nodeHash, sizeof(uint64_t), n, file) != n) {
+    fclose(file);
+    tree_free(param);
+    errno = EINVAL;
+    return -1;
+  }
+  fclose(file);
+
+  param->dirty = calloc(n, 1);
+  int unchanged = (header.ino == (uint64_t)st->st_ino && header.mtimeSec == st->st_mtim.tv_sec
+                   && header.mtimeNsec == st->st_mtim.tv_nsec);
+
+  // no ranges and a changed file means we can't know what moved
+  if (!unchanged && numRanges == 0) {
+    memset(param->dirty, 1, n);
+    return n;
+  }
+  return mark_dirty(param, ranges, numRanges);
+}
+
+// write the whole tree next to the file, through a temp file so a crash never leaves half a sidecar
+static int sidecar_save(const char* path, const struct htree_tree* param, const struct stat* st)
+{
+  struct sidecarHeader header;
+  char tmp[4096];
+  uint n = param->numThread;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SIDECAR_MAGIC, 8);
+  header.blockSize = param->blockSize;
+  header.numThread = n;
+  header.hashKind = param->hashKind;
+  header.fileSize = param->fileSize;
+  header.ino = st->st_ino;
+  header.mtimeSec = st->st_mtim.tv_sec;
+  header.mtimeNsec = st->st_mtim.tv_nsec;
+  header.root = param->nodeHash[0];
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE* file = fopen(tmp, "w");
+  if (file == NULL)
+    return -1;
+  if (fwrite(&header, sizeof(header), 1, file) != 1
+      || fwrite(param->chunkHash, sizeof(uint64_t), n, file) != n
+      || fwrite(param->nodeHash, sizeof(uint64_t), n, file) != n
+      || fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    int err = errno;
+    fclose(file);
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+  fclose(file);
+  return rename(tmp, path);
+}
+
+// reader thread for streaming mode, fills whichever buffer the hashing side has handed back
+static void* read_input(void* arg)
+{
+  struct reader* r = (struct reader*) arg;
+  uint64_t off = 0;
+
+  for (int i = 0; off < r->size; i ^= 1) {
+    struct streamBuf* b = &r->bufs[i];
+
+    pthread_mutex_lock(&r->lock);
+    while (b->full)
+      pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
+    // fill the whole buffer, pipes and sockets hand data over in small pieces. O_DIRECT reads
+    // have to be whole aligned blocks, the file just ends partway through the last one
+    uint64_t want = (r->size - off < STREAM_BUF) ? r->size - off : STREAM_BUF;
+    uint64_t ask = (r->flags & STREAM_DIRECT) ? (want + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN : want;
+    uint64_t got = 0;
+    while (got < want) {
+      ssize_t res;
+      if (r->flags & STREAM_DIRECT)
+        res = pread(r->fd, b->data + got, ask - got, off + got);
+      else
+        res = read(r->fd, b->data + got, want - got);
+      if (res == -1 && errno == EINTR)
+        continue;
+      if (res <= 0) {
+        pthread_mutex_lock(&r->lock);
+        r->err = (res == 0) ? -1 : errno;
+        r->finished = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+      }
+      got += res;
+    }
+    if (got > want)
+      got = want;
+
+    pthread_mutex_lock(&r->lock);
+    b->off = off;
+    b->len = got;
+    b->full = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    off += got;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  r->finished = 1;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return NULL;
+}
+
+// get a tree ready to be fed front to back through stream_pieces
+static void stream_begin(struct htree_tree* param)
+{
+  tree_setup(param);
+  param->chunkState = malloc(param->numThread * sizeof(struct hashState));
+  for (uint tid = 0; tid < param->numThread; tid++)
+    hash_init(param->hashKind, &param->chunkState[tid]);
+}
+
+// hash len bytes of the input that start at off, cut at chunk boundaries. Each chunk's share is
+// one task that continues that chunk's running hash, chunks that sit wholly inside the data are
+// grouped so they share the lanes kernel. The part past the last chunk isn't hashed (same as
+// mmap mode). Returns once every piece is done since a chunk's next piece can't start before
+static void stream_pieces(struct pool* pool, struct htree_tree* param, uint64_t off, const uint8_t* data, uint64_t len)
+{
+  uint64_t covered = param->chunkSize * param->numThread;
+  uint64_t end = (off + len < covered) ? off + len : covered;
+
+  if (off >= end)
+    return;
+
+  uint first = off / param->chunkSize;
+  uint last = (end - 1) / param->chunkSize;
+  // groups no bigger than it takes to give every worker one
+  uint lanes = hash_lanes();
+  uint perWorker = (last - first + pool->numWorkers) / pool->numWorkers;
+  if (perWorker < lanes)
+    lanes = perWorker;
+  for (uint tid = first; tid <= last; ) {
+    uint64_t from = (tid * param->chunkSize > off) ? tid * param->chunkSize : off;
+    uint64_t to = ((tid + 1) * param->chunkSize < end) ? (tid + 1) * param->chunkSize : end;
+    uint count = 1;
+    if (to - from == param->chunkSize) {
+      while (count < lanes && tid + count <= last && (tid + count + 1) * param->chunkSize <= end)
+        count++;
+    }
+    struct task t = { TASK_PIECE, tid, count, param, data + (from - off), to - from };
+    __atomic_add_fetch(&param->piecesLeft, 1, __ATOMIC_ACQ_REL);
+    pool_push(pool, tid % pool->numWorkers, t);
+    tid += count;
+  }
+
+  pthread_mutex_lock(&param->lock);
+  while (__atomic_load_n(&param->piecesLeft, __ATOMIC_ACQUIRE) != 0)
+    pthread_cond_wait(&param->done, &param->lock);
+  pthread_mutex_unlock(&param->lock);
+}
+
+// all input went through stream_pieces: the last block is padded with zeros like the mmap path,
+// then every running hash gets finished and only the combines are left for tree()
+static void stream_end(struct htree_tree* param)
+{
+  for (uint tid = 0; tid < param->numThread; tid++) {
+    uint64_t start = tid * param->chunkSize;
+    uint64_t stop = start + param->chunkSize;
+    if (stop > param->fileSize)
+      hash_zeros(param->hashKind, &param->chunkState[tid], stop - (start > param->fileSize ? start : param->fileSize));
+    param->chunkHash[tid] = hash_final(param->hashKind, &param->chunkState[tid]);
+  }
+  param->chunksDone = 1;
+}
+
+// hash every chunk by reading the input front to back instead of mapping it. A reader thread
+// fills one buffer while the pool hashes the other. Returns 0 when chunkHash is ready for
+// tree(), -1 with errno set if the read failed (EIO if the input ended early)
+static int stream_file(struct pool* pool, struct htree_tree* param, int fd, int flags)
+{
+  struct reader r;
+  pthread_t readThread;
+
+  stream_begin(param);
+
+  memset(&r, 0, sizeof(r));
+  r.fd = fd;
+  r.flags = flags;
+  r.size = param->fileSize;
+  pthread_mutex_init(&r.lock, NULL);
+  pthread_cond_init(&r.cond, NULL);
+  for (int i = 0; i < 2; i++) {
+    // 2M aligned so they can be backed with huge pages
+    r.bufs[i].data = aligned_alloc(2 << 20, STREAM_BUF);
+    if (pool->place->huge && madvise(r.bufs[i].data, STREAM_BUF, MADV_HUGEPAGE) != 0)
+      huge_refused(pool->place);
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  pthread_create(&readThread, NULL, read_input, &r);
+
+  for (int i = 0; ; i ^= 1) {
+    struct streamBuf* b = &r.bufs[i];
+
+    pthread_mutex_lock(&r.lock);
+    while (!b->full && !r.finished)
+      pthread_cond_wait(&r.cond, &r.lock);
+    int more = b->full;
+    pthread_mutex_unlock(&r.lock);
+    if (!more)
+      break;
+
+    stream_pieces(pool, param, b->off, b->data, b->len);
+    if (flags & STREAM_DROP)
+      posix_fadvise(fd, b->off, b->len, POSIX_FADV_DONTNEED);
+
+    pthread_mutex_lock(&r.lock);
+    b->full = 0;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+  }
+
+  pthread_join(readThread, NULL);
+  for (int i = 0; i < 2; i++)
+    free(r.bufs[i].data);
+  pthread_mutex_destroy(&r.lock);
+  pthread_cond_destroy(&r.cond);
+
+  if (r.err != 0) {
+    errno = (r.err == -1) ? EIO : r.err;
+    return -1;
+  }
+  stream_end(param);
+  return 0;
+}
+
+// an io_uring set up by hand with the raw syscalls, just enough of it to queue reads
+struct uring{
+  int fd;
+  uint* sqHead;
+  uint* sqTail;
+  uint* sqMask;
+  uint* sqArray;
+  struct io_uring_sqe* sqes;
+  uint* cqHead;
+  uint* cqTail;
+  uint* cqMask;
+  struct io_uring_cqe* cqes;
+  void* sqRing;
+  void* cqRing;
+  size_t sqLen;
+  size_t cqLen;
+  size_t sqesLen;
+  uint toSubmit;    // queued in the ring but not handed to the kernel yet
+};
+
+// returns -1 with errno set if the kernel doesn't have io_uring or won't let us use it
+static int uring_init(struct uring* u, uint entries)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  memset(u, 0, sizeof(*u));
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (u->fd == -1)
+    return -1;
+
+  u->sqLen = p.sq_off.array + p.sq_entries * sizeof(uint);
+  u->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cqLen > u->sqLen)
+      u->sqLen = u->cqLen;
+    u->cqLen = u->sqLen;
+  }
+  u->sqRing = mmap(NULL, u->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sqRing == MAP_FAILED)
+    goto fail;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    u->cqRing = u->sqRing;
+  else
+    u->cqRing = mmap(NULL, u->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+  if (u->cqRing == MAP_FAILED)
+    goto fail;
+  u->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto fail;
+
+  u->sqHead = (uint*)((char*)u->sqRing + p.sq_off.head);
+  u->sqTail = (uint*)((char*)u->sqRing + p.sq_off.tail);
+  u->sqMask = (uint*)((char*)u->sqRing + p.sq_off.ring_mask);
+  u->sqArray = (uint*)((char*)u->sqRing + p.sq_off.array);
+  u->cqHead = (uint*)((char*)u->cqRing + p.cq_off.head);
+  u->cqTail = (uint*)((char*)u->cqRing + p.cq_off.tail);
+  u->cqMask = (uint*)((char*)u->cqRing + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)((char*)u->cqRing + p.cq_off.cqes);
+  return 0;
+
+fail:;
+  int err = errno;
+  close(u->fd);
+  errno = err;
+  return -1;
+}
+
+static void uring_free(struct uring* u)
+{
+  munmap(u->sqes, u->sqesLen);
+  if (u->cqRing != u->sqRing)
+    munmap(u->cqRing, u->cqLen);
+  munmap(u->sqRing, u->sqLen);
+  close(u->fd);
+}
+
+// queue a readv, it goes to the kernel with the next uring_wait
+static void uring_readv(struct uring* u, int fd, const struct iovec* iov, uint64_t off, uint64_t tag)
+{
+  uint tail = *u->sqTail;
+  uint idx = tail & *u->sqMask;
+  struct io_uring_sqe* sqe = &u->sqes[idx];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)iov;
+  sqe->len = 1;
+  sqe->off = off;
+  sqe->user_data = tag;
+  u->sqArray[idx] = idx;
+  __atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+  u->toSubmit++;
+}
+
+// submit what's queued and take one completion, waiting for it if wait is set. Returns 1 with
+// the completion, 0 if there was none and we weren't to wait, -1 with errno on failure
+static int uring_wait(struct uring* u, struct io_uring_cqe* cqe, int wait)
+{
+  for (;;) {
+    uint head = *u->cqHead;
+    if (head != __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)) {
+      *cqe = u->cqes[head & *u->cqMask];
+      __atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+    if (!wait && u->toSubmit == 0)
+      return 0;
+    int res = syscall(__NR_io_uring_enter, u->fd, u->toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res == -1) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    u->toSubmit -= res;
+    if (!wait && u->toSubmit == 0 && head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE))
+      return 0;
+  }
+}
+
+// direct mode: the file is read in DIRECT_BUF pieces into a ring of depth buffers and io_uring
+// keeps the reads going ahead of the hashing. Finished buffers are hashed oldest first, in runs
+// of up to half the ring so the other half stays in flight. A read that comes back short before
+// the end of the file is finished with pread on the plain fd. Same return as stream_file
+static int uring_file(struct pool* pool, struct htree_tree* param, struct uring* u, int fd, int plainFd, uint depth, int drop)
+{
+  uint64_t size = param->fileSize;
+  uint64_t total = (size + DIRECT_BUF - 1) / DIRECT_BUF;
+  uint8_t* base = aligned_alloc(DIRECT_ALIGN, (size_t)depth * DIRECT_BUF);
+  struct iovec* iov = malloc(depth * sizeof(struct iovec));
+  uint8_t* ready = calloc(depth, 1);
+  uint64_t nextSubmit = 0, nextHash = 0;
+  uint inFlight = 0, maxRun = (depth > 1) ? depth / 2 : 1;
+  int err = 0;
+
+  stream_begin(param);
+  for (; nextSubmit < total && nextSubmit < depth; nextSubmit++) {
+    uint slot = nextSubmit % depth;
+    uint64_t want = (size - nextSubmit * DIRECT_BUF < DIRECT_BUF) ? size - nextSubmit * DIRECT_BUF : DIRECT_BUF;
+    iov[slot].iov_base = base + (size_t)slot * DIRECT_BUF;
+    iov[slot].iov_len = (want + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    uring_readv(u, fd, &iov[slot], nextSubmit * DIRECT_BUF, nextSubmit);
+    inFlight++;
+  }
+
+  while (nextHash < total && err == 0) {
+    // take whatever has finished, only blocking while the oldest buffer isn't in yet
+    struct io_uring_cqe cqe;
+    int res;
+    while (err == 0 && (res = uring_wait(u, &cqe, !ready[nextHash % depth])) != 0) {
+      if (res == -1) {
+        err = errno;
+        break;
+      }
+      inFlight--;
+      uint64_t k = cqe.user_data;
+      uint slot = k % depth;
+      uint64_t want = (size - k * DIRECT_BUF < DIRECT_BUF) ? size - k * DIRECT_BUF : DIRECT_BUF;
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        uring_readv(u, fd, &iov[slot], k * DIRECT_BUF, k);
+        inFlight++;
+        continue;
+      }
+      if (cqe.res < 0) {
+        err = -cqe.res;
+        break;
+      }
+      for (uint64_t got = cqe.res; got < want; ) {
+        ssize_t n = pread(plainFd, base + (size_t)slot * DIRECT_BUF + got, want - got, k * DIRECT_BUF + got);
+        if (n == -1 && errno == EINTR)
+          continue;
+        if (n <= 0) {
+          err = (n == 0) ? EIO : errno;
+          break;
+        }
+        got += n;
+      }
+      ready[slot] = 1;
+    }
+    if (err != 0)
+      break;
+
+    // a run of finished buffers that sit next to each other in the ring
+    uint run = 1;
+    while (run < maxRun && nextHash + run < nextSubmit && (nextHash + run) % depth != 0 && ready[(nextHash + run) % depth])
+      run++;
+    uint64_t off = nextHash * DIRECT_BUF;
+    uint64_t len = ((nextHash + run) * DIRECT_BUF < size) ? (uint64_t)run * DIRECT_BUF : size - off;
+    stream_pieces(pool, param, off, base + (size_t)(nextHash % depth) * DIRECT_BUF, len);
+    if (drop)
+      posix_fadvise(plainFd, off, len, POSIX_FADV_DONTNEED);
+
+    // the freed buffers take the next reads, in order so buffer k always holds piece k % depth
+    for (uint i = 0; i < run; i++, nextHash++) {
+      ready[nextHash % depth] = 0;
+      if (nextSubmit < total) {
+        uint slot = nextSubmit % depth;
+        uint64_t want = (size - nextSubmit * DIRECT_BUF < DIRECT_BUF) ? size - nextSubmit * DIRECT_BUF : DIRECT_BUF;
+        iov[slot].iov_len = (want + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        uring_readv(u, fd, &iov[slot], nextSubmit * DIRECT_BUF, nextSubmit);
+        inFlight++;
+        nextSubmit++;
+      }
+    }
+  }
+
+  // the kernel may still write into the buffers, so they stay until every read is back
+  struct io_uring_cqe cqe;
+  while (inFlight > 0 && uring_wait(u, &cqe, 1) == 1)
+    inFlight--;
+  free(base);
+  free(iov);
+  free(ready);
+
+  if (err != 0) {
+    errno = err;
+    return -1;
+  }
+  stream_end(param);
+  return 0;
+}
+
+// direct mode for a regular file: a second O_DIRECT descriptor for the file so the caller's
+// stays as it is, or the plain one with pages dropped behind us if the filesystem won't do
+// O_DIRECT. io_uring does the reads, or the streaming reader thread with pread without it
+static int direct_file(struct htree* ctx, struct htree_tree* param, int fd)
+{
+  char path[64];
+  uint depth = ctx->cfg.queueDepth ? ctx->cfg.queueDepth : DIRECT_DEPTH;
+  struct uring u;
+  int res;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  int dfd = open(path, O_RDONLY | O_DIRECT);
+  int directErr = (dfd == -1) ? errno : 0;
+  int drop = (dfd == -1);
+  if (dfd == -1)
+    dfd = fd;
+
+  int uring = (uring_init(&u, depth) == 0);
+  int uringErr = uring ? 0 : errno;
+  pthread_mutex_lock(&ctx->lock);
+  ctx->engine = uring ? HTREE_ENGINE_URING : HTREE_ENGINE_PREAD;
+  ctx->directErr = directErr;
+  ctx->uringErr = uringErr;
+  pthread_mutex_unlock(&ctx->lock);
+
+  if (uring) {
+    res = uring_file(ctx->pool, param, &u, dfd, fd, depth, drop);
+    uring_free(&u);
+  }
+  else
+    res = stream_file(ctx->pool, param, dfd, (drop ? STREAM_DROP : STREAM_DIRECT));
+
+  if (dfd != fd) {
+    int err = errno;
+    close(dfd);
+    errno = err;
+  }
+  return res;
+}
+
+// number of blocks in the file, the last one may be partial
+uint64_t htree_count_blocks(uint64_t fileSize, uint64_t blockSize)
+{
+  if (fileSize % blockSize != 0)
+    return (fileSize / blockSize) + 1;
+  return fileSize / blockSize;
+}
+
+// write the inclusion proof of the chunk holding block: the subtree hashes of its node's
+// children, then for every ancestor on the way up its own chunk hash and the subtree hash of
+// the other child ("-" if there is none). That's enough to get from the chunk to the root with
+// one hash per level
+int htree_tree_prove(const struct htree_tree* param, uint64_t block, FILE* out)
+{
+  uint n = param->numThread;
+  uint depth = 0;
+
+  // blocks past the last whole chunk aren't in the tree at all
+  uint64_t blocksPerNode = param->chunkSize / param->blockSize;
+  if (blocksPerNode == 0 || block / blocksPerNode >= n) {
+    errno = ERANGE;
+    return -1;
+  }
+  uint tid = block / blocksPerNode;
+  uint left = 2 * tid + 1;
+
+  fprintf(out, "htree-proof 1\n");
+  fprintf(out, "hash %s\n", param->hashKind == HTREE_XXH64 ? "xxh64" : "jenkins");
+  fprintf(out, "block_size %" PRIu64 "\n", param->blockSize);
+  fprintf(out, "num_threads %u\n", n);
+  fprintf(out, "file_size %" PRIu64 "\n", param->fileSize);
+  fprintf(out, "node %u\n", tid);
+  fprintf(out, "chunk %" PRIu64 " %" PRIu64 "\n", tid * param->chunkSize, param->chunkSize);
+
+  fprintf(out, "children %u", (left < n) + (left + 1 < n));
+  for (uint c = left; c < n && c <= left + 1; c++)
+    fprintf(out, " %" PRIu64, param->nodeHash[c]);
+  fprintf(out, "\n");
+
+  for (uint t = tid; t > 0; t = (t - 1) / 2)
+    depth++;
+  fprintf(out, "path %u\n", depth);
+  for (uint t = tid; t > 0; t = (t - 1) / 2) {
+    uint sibling = (t % 2) ? t + 1 : t - 1;
+    fprintf(out, "%" PRIu64, param->chunkHash[(t - 1) / 2]);
+    if (sibling < n)
+      fprintf(out, " %" PRIu64 "\n", param->nodeHash[sibling]);
+    else
+      fprintf(out, " -\n");
+  }
+  fprintf(out, "root %" PRIu64 "\n", param->nodeHash[0]);
+  return tid;
+}
+
+// check a chunk with a proof from htree_tree_prove. Only that chunk is read, with pread from
+// its place in fd or, with chunkOnly, as just the chunk's bytes, and then it's one hash per
+// tree level
+int htree_verify(FILE* proof, int fd, int chunkOnly, struct htreeCheck* check)
+{
+  char kindName[16];
+  unsigned version;
+  uint64_t blockSize, fileSize, chunkOff, chunkLen;
+  uint numThread, tid, numKids, depth;
+  uint64_t kids[2];
+
+  // the header has to describe a tree the node actually fits in
+  if (fscanf(proof, " htree-proof %u hash %15s block_size %" SCNu64 " num_threads %u file_size %" SCNu64
+             " node %u chunk %" SCNu64 " %" SCNu64 " children %u", &version, kindName, &blockSize, &numThread,
+             &fileSize, &tid, &chunkOff, &chunkLen, &numKids) != 9
+      || version != 1 || blockSize == 0 || numThread == 0 || tid >= numThread
+      || (strcmp(kindName, "jenkins") != 0 && strcmp(kindName, "xxh64") != 0))
+    goto malformed;
+  int hashKind = strcmp(kindName, "xxh64") == 0 ? HTREE_XXH64 : HTREE_JENKINS;
+  uint64_t chunkSize = (htree_count_blocks(fileSize, blockSize) / numThread) * blockSize;
+  uint left = 2 * tid + 1;
+  if (chunkOff != tid * chunkSize || chunkLen != chunkSize || numKids != (uint)((left < numThread) + (left + 1 < numThread)))
+    goto malformed;
+  for (uint k = 0; k < numKids; k++) {
+    if (fscanf(proof, "%" SCNu64, &kids[k]) != 1)
+      goto malformed;
+  }
+
+  // hash the chunk, anything past the end of the file counts as zeros like in tree()
+  uint64_t avail = 0;
+  if (chunkOff < fileSize)
+    avail = (fileSize - chunkOff < chunkSize) ? fileSize - chunkOff : chunkSize;
+  struct hashState state;
+  uint8_t* buf = malloc(1 << 20);
+  hash_init(hashKind, &state);
+  for (uint64_t got = 0; got < avail; ) {
+    uint64_t want = (avail - got < (1 << 20)) ? avail - got : (1 << 20);
+    ssize_t res = chunkOnly ? read(fd, buf, want) : pread(fd, buf, want, chunkOff + got);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0) {
+      free(buf);
+      errno = EIO;
+      return -1;
+    }
+    hash_update(hashKind, &state, buf, res);
+    got += res;
+  }
+  hash_zeros(hashKind, &state, chunkSize - avail);
+  check->chunkHash = hash_final(hashKind, &state);
+  free(buf);
+
+  // then up the tree, the other child goes left or right depending on which side we came from
+  uint64_t value = combine_hash(hashKind, check->chunkHash, kids, numKids);
+  check->hashes = 1 + (numKids > 0);
+  if (fscanf(proof, " path %u", &depth) != 1)
+    goto malformed;
+  uint t = tid;
+  for (uint level = 0; level < depth; level++, t = (t - 1) / 2) {
+    uint64_t parentChunk, sibling;
+    char sibText[32];
+    if (t == 0 || fscanf(proof, "%" SCNu64 " %31s", &parentChunk, sibText) != 2)
+      goto malformed;
+    uint sib = (t % 2) ? t + 1 : t - 1;
+    if ((sib < numThread) != (strcmp(sibText, "-") != 0) || (sib < numThread && sscanf(sibText, "%" SCNu64, &sibling) != 1))
+      goto malformed;
+    if (sib >= numThread) {
+      kids[0] = value;
+      numKids = 1;
+    }
+    else {
+      kids[0] = (t % 2) ? value : sibling;
+      kids[1] = (t % 2) ? sibling : value;
+      numKids = 2;
+    }
+    value = combine_hash(hashKind, parentChunk, kids, numKids);
+    check->hashes++;
+  }
+  if (t != 0 || fscanf(proof, " root %" SCNu64, &check->proofRoot) != 1)
+    goto malformed;
+  check->root = value;
+  return 0;
+
+malformed:
+  errno = EINVAL;
+  return -1;
+}
+
+// hash function
+static uint32_t jenkins_one_at_a_time_hash(const uint8_t* key, uint64_t length)
+{
+  return jenkins_final(jenkins_update(0, key, length));
+}
+
+// the per byte part of the hash, can be fed a chunk in pieces
+static uint32_t jenkins_update(uint32_t hash, const uint8_t* key, uint64_t length)
+{
+  uint64_t i = 0;
+
+  while (i != length) {
+    hash += key[i++];
+    hash += hash << 10;
+    hash ^= hash >> 6;
+  }
+  return hash;
+}
+
+// final mixing once every byte has gone through jenkins_update
+static uint32_t jenkins_final(uint32_t hash)
+{
+  hash += hash << 3;
+  hash ^= hash >> 11;
+  hash += hash << 15;
+  return hash;
+}
+
+// jenkins_update on n independent keys of the same length at once. Going byte by byte across
+// the lanes breaks up the serial chain of a single hash so the cpu can overlap them
+static void jenkins_lanes_scalar(uint32_t* hash, const uint8_t* const* key, uint64_t length, uint n)
+{
+  uint32_t h[16];
+  memcpy(h, hash, n * sizeof(uint32_t));
+
+  for (uint64_t i = 0; i < length; i++) {
+    for (uint l = 0; l < n; l++) {
+      h[l] += key[l][i];
+      h[l] += h[l] << 10;
+      h[l] ^= h[l] >> 6;
+    }
+  }
+  memcpy(hash, h, n * sizeof(uint32_t));
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+// one jenkins byte step on every lane, b holds one byte per 32 bit lane
+#define JENKINS_STEP256(h, b) \
+  h = _mm256_add_epi32(h, b); \
+  h = _mm256_add_epi32(h, _mm256_slli_epi32(h, 10)); \
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 6));
+
+#define JENKINS_STEP512(h, b) \
+  h = _mm512_add_epi32(h, b); \
+  h = _mm512_add_epi32(h, _mm512_slli_epi32(h, 10)); \
+  h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 6));
+
+// 8 lanes in one avx2 register, every 4 bytes of each key are gathered into the lanes and
+// then run through 4 byte steps. Leftover bytes at the end go through the scalar version
+__attribute__((target("avx2")))
+static void jenkins_lanes_avx2(uint32_t* hash, const uint8_t* const* key, uint64_t length, uint n)
+{
+  __m256i h = _mm256_loadu_si256((const __m256i*)hash);
+  __m256i lo = _mm256_setr_epi64x(0, key[1] - key[0], key[2] - key[0], key[3] - key[0]);
+  __m256i hi = _mm256_setr_epi64x(key[4] - key[0], key[5] - key[0], key[6] - key[0], key[7] - key[0]);
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  uint64_t i = 0;
+
+  for (; i + 4 <= length; i += 4) {
+    const int* base = (const int*)(key[0] + i);
+    __m256i w = _mm256_set_m128i(_mm256_i64gather_epi32(base, hi, 1), _mm256_i64gather_epi32(base, lo, 1));
+    JENKINS_STEP256(h, _mm256_and_si256(w, mask));
+    JENKINS_STEP256(h, _mm256_and_si256(_mm256_srli_epi32(w, 8), mask));
+    JENKINS_STEP256(h, _mm256_and_si256(_mm256_srli_epi32(w, 16), mask));
+    JENKINS_STEP256(h, _mm256_srli_epi32(w, 24));
+  }
+  _mm256_storeu_si256((__m256i*)hash, h);
+
+  const uint8_t* rest[8];
+  for (uint l = 0; l < 8; l++)
+    rest[l] = key[l] + i;
+  jenkins_lanes_scalar(hash, rest, length - i, n);
+}
+
+// same as the avx2 version with 16 lanes
+__attribute__((target("avx512f")))
+static void jenkins_lanes_avx512(uint32_t* hash, const uint8_t* const* key, uint64_t length, uint n)
+{
+  __m512i h = _mm512_loadu_si512((const void*)hash);
+  __m512i lo = _mm512_setr_epi64(0, key[1] - key[0], key[2] - key[0], key[3] - key[0],
+                                 key[4] - key[0], key[5] - key[0], key[6] - key[0], key[7] - key[0]);
+  __m512i hi = _mm512_setr_epi64(key[8] - key[0], key[9] - key[0], key[10] - key[0], key[11] - key[0],
+                                 key[12] - key[0], key[13] - key[0], key[14] - key[0], key[15] - key[0]);
+  const __m512i mask = _mm512_set1_epi32(0xff);
+  uint64_t i = 0;
+
+  for (; i + 4 <= length; i += 4) {
+    const void* base = key[0] + i;
+    __m512i w = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_i64gather_epi32(lo, base, 1)),
+                                   _mm512_i64gather_epi32(hi, base, 1), 1);
+    JENKINS_STEP512(h, _mm512_and_si512(w, mask));
+    JENKINS_STEP512(h, _mm512_and_si512(_mm512_srli_epi32(w, 8), mask));
+    JENKINS_STEP512(h, _mm512_and_si512(_mm512_srli_epi32(w, 16), mask));
+    JENKINS_STEP512(h, _mm512_srli_epi32(w, 24));
+  }
+  _mm512_storeu_si512((void*)hash, h);
+
+  const uint8_t* rest[16];
+  for (uint l = 0; l < 16; l++)
+    rest[l] = key[l] + i;
+  jenkins_lanes_scalar(hash, rest, length - i, n);
+}
+#endif
+
+// picked once per process by hash_dispatch, through hash_lanes
+static pthread_once_t dispatchOnce = PTHREAD_ONCE_INIT;
+static uint numLanes = 8;
+static void (*lanesKernel)(uint32_t*, const uint8_t* const*, uint64_t, uint) = jenkins_lanes_scalar;
+static const char* kernelName = "scalar";
+
+// use the widest lanes kernel this cpu runs
+static void hash_dispatch()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    numLanes = 16;
+    lanesKernel = jenkins_lanes_avx512;
+    kernelName = "avx512";
+  }
+  else if (__builtin_cpu_supports("avx2")) {
+    numLanes = 8;
+    lanesKernel = jenkins_lanes_avx2;
+    kernelName = "avx2";
+  }
+#endif
+}
+
+// how many nodes one leaf task should hash together
+static uint hash_lanes()
+{
+  pthread_once(&dispatchOnce, hash_dispatch);
+  return numLanes;
+}
+
+// run n (at most 16) jenkins hashes of equal length key side by side. A partial set of lanes
+// still goes to the vector kernel, the spare lanes just rehash the first key and get dropped
+static void jenkins_lanes(uint32_t* hash, const uint8_t* const* key, uint64_t length, uint n)
+{
+  if (n == numLanes) {
+    lanesKernel(hash, key, length, n);
+  }
+  else if (n > 1 && lanesKernel != jenkins_lanes_scalar) {
+    const uint8_t* keys[16];
+    uint32_t h[16];
+    for (uint l = 0; l < numLanes; l++) {
+      keys[l] = key[l < n ? l : 0];
+      h[l] = hash[l < n ? l : 0];
+    }
+    lanesKernel(h, keys, length, numLanes);
+    memcpy(hash, h, n * sizeof(uint32_t));
+  }
+  else {
+    jenkins_lanes_scalar(hash, key, length, n);
+  }
+}
+
+// xxh64 (seed 0), a 64 bit hash that reads 8 bytes at a time over 4 independent accumulators
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh64_stripe(struct hashState* s, const uint8_t* p)
+{
+  s->v[0] = xxh64_round(s->v[0], read64(p));
+  s->v[1] = xxh64_round(s->v[1], read64(p + 8));
+  s->v[2] = xxh64_round(s->v[2], read64(p + 16));
+  s->v[3] = xxh64_round(s->v[3], read64(p + 24));
+}
+
+static void xxh64_update(struct hashState* s, const uint8_t* p, uint64_t len)
+{
+  s->total += len;
+
+  // not a full stripe yet, keep it for later
+  if (s->memSize + len < 32) {
+    memcpy(s->mem + s->memSize, p, len);
+    s->memSize += len;
+    return;
+  }
+
+  if (s->memSize > 0) {
+    uint32_t fill = 32 - s->memSize;
+    memcpy(s->mem + s->memSize, p, fill);
+    xxh64_stripe(s, s->mem);
+    p += fill;
+    len -= fill;
+    s->memSize = 0;
+  }
+
+  for (; len >= 32; p += 32, len -= 32)
+    xxh64_stripe(s, p);
+
+  memcpy(s->mem, p, len);
+  s->memSize = len;
+}
+
+static uint64_t xxh64_final(struct hashState* s)
+{
+  uint64_t h;
+  const uint8_t* p = s->mem;
+  uint32_t len = s->memSize;
+
+  if (s->total >= 32) {
+    h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+    for (int i = 0; i < 4; i++)
+      h = xxh64_merge(h, s->v[i]);
+  }
+  else {
+    h = PRIME64_5;
+  }
+  h += s->total;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+  if (len >= 4) {
+    uint32_t k;
+    memcpy(&k, p, sizeof(k));
+    h ^= (uint64_t)k * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len > 0; p++, len--) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// start a running hash of the given kind
+static void hash_init(int kind, struct hashState* s)
+{
+  memset(s, 0, sizeof(*s));
+  if (kind == HTREE_XXH64) {
+    s->v[0] = PRIME64_1 + PRIME64_2;
+    s->v[1] = PRIME64_2;
+    s->v[2] = 0;
+    s->v[3] = -PRIME64_1;
+  }
+}
+
+// feed more bytes into a running hash
+static void hash_update(int kind, struct hashState* s, const uint8_t* key, uint64_t length)
+{
+  if (kind == HTREE_XXH64)
+    xxh64_update(s, key, length);
+  else
+    s->v[0] = jenkins_update(s->v[0], key, length);
+}
+
+// finish a running hash
+static uint64_t hash_final(int kind, struct hashState* s)
+{
+  if (kind == HTREE_XXH64)
+    return xxh64_final(s);
+  return jenkins_final(s->v[0]);
+}
+
+// hash one whole buffer
+static uint64_t hash_block(int kind, const uint8_t* key, uint64_t length)
+{
+  struct hashState s;
+
+  if (kind == HTREE_JENKINS)
+    return jenkins_one_at_a_time_hash(key, length);
+  hash_init(kind, &s);
+  hash_update(kind, &s, key, length);
+  return hash_final(kind, &s);
+}
+
+// keeps the errno of the first refused MADV_HUGEPAGE, workers can be mapping at the same time
+static void huge_refused(struct placement* place)
+{
+  int none = 0;
+  __atomic_compare_exchange_n(&place->hugeErr, &none, errno, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// map a whole file read only with the context's advice and huge page settings
+static uint8_t* map_file(struct placement* place, int fd, uint64_t size)
+{
+  int flags = MAP_PRIVATE;
+
+  if (place->advice == HTREE_ADVISE_POPULATE)
+    flags |= MAP_POPULATE;
+  uint8_t* addr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+  if (addr == MAP_FAILED)
+    return addr;
+
+  if (place->advice == HTREE_ADVISE_SEQ)
+    madvise(addr, size, MADV_SEQUENTIAL);
+  // file backed huge pages need kernel and filesystem support, without it this is refused
+  if (place->huge && madvise(addr, size, MADV_HUGEPAGE) != 0)
+    huge_refused(place);
+  return addr;
+}
+
+// the public side, see htree.h
+
+struct htree* htree_create(const struct htreeConfig* cfg)
+{
+  struct htree* ctx = calloc(1, sizeof(struct htree));
+
+  ctx->cfg = *cfg;
+  if (ctx->cfg.numWorkers == 0)
+    ctx->cfg.numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ctx->cfg.numThread == 0)
+    ctx->cfg.numThread = 1;
+  if (ctx->cfg.blockSize == 0)
+    ctx->cfg.blockSize = HTREE_BSIZE;
+  ctx->place.pin = cfg->pin;
+  ctx->place.advice = cfg->advice;
+  ctx->place.huge = cfg->huge;
+
+  ctx->pool = pool_create(ctx->cfg.numWorkers, &ctx->place);
+  if (ctx->pool == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  pthread_mutex_init(&ctx->lock, NULL);
+  return ctx;
+}
+
+void htree_destroy(struct htree* ctx)
+{
+  pool_destroy(ctx->pool);
+  pthread_mutex_destroy(&ctx->lock);
+  free(ctx);
+}
+
+const char* htree_kernel(uint* lanes)
+{
+  *lanes = hash_lanes();
+  return kernelName;
+}
+
+void htree_placement(struct htree* ctx, uint* numCpus, uint* numNodes, int* hugeErr)
+{
+  *numCpus = ctx->pool->numCpus;
+  *numNodes = ctx->pool->numNodes;
+  *hugeErr = __atomic_load_n(&ctx->place.hugeErr, __ATOMIC_RELAXED);
+}
+
+int htree_engine(struct htree* ctx, int* directErr, int* uringErr)
+{
+  pthread_mutex_lock(&ctx->lock);
+  int engine = ctx->engine;
+  *directErr = ctx->directErr;
+  *uringErr = ctx->uringErr;
+  pthread_mutex_unlock(&ctx->lock);
+  return engine;
+}
+
+// a tree of the context's shape over size bytes, nothing allocated yet
+static void tree_init(struct htree* ctx, struct htree_tree* param, const void* data, uint64_t size)
+{
+  memset(param, 0, sizeof(*param));
+  param->numThread = ctx->cfg.numThread;
+  param->blockSize = ctx->cfg.blockSize;
+  param->hashKind = ctx->cfg.hashKind;
+  param->fileSize = size;
+  param->chunkSize = (htree_count_blocks(size, param->blockSize) / param->numThread) * param->blockSize;
+  param->mapAddr = (uint8_t*)data;
+}
+
+int htree_hash_buffer(struct htree* ctx, const void* data, uint64_t len, uint64_t* root)
+{
+  struct htree_tree param;
+
+  tree_init(ctx, &param, data, len);
+  if (len < INLINE_BUF) {
+    *root = tree_inline(&param);
+    return 0;
+  }
+  *root = tree(ctx->pool, &param);
+  tree_free(&param);
+  return 0;
+}
+
+// the buffers go through the streaming pieces one after the other, so chunks can span them
+int htree_hash_iovec(struct htree* ctx, const struct iovec* iov, int iovcnt, uint64_t* root)
+{
+  struct htree_tree param;
+  uint64_t size = 0;
+
+  if (iovcnt == 1)
+    return htree_hash_buffer(ctx, iov[0].iov_base, iov[0].iov_len, root);
+  for (int i = 0; i < iovcnt; i++)
+    size += iov[i].iov_len;
+  tree_init(ctx, &param, NULL, size);
+
+  stream_begin(&param);
+  uint64_t off = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    stream_pieces(ctx->pool, &param, off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  stream_end(&param);
+  *root = tree(ctx->pool, &param);
+  tree_free(&param);
+  return 0;
+}
+
+// regular files are mapped unless the context streams, anything else is streamed and needs its
+// size given. A file that can't be mapped is streamed instead
+int htree_hash_fd(struct htree* ctx, int fd, int64_t size, uint64_t* root)
+{
+  struct htree_tree param;
+  struct stat st;
+  int streaming = ctx->cfg.streaming;
+
+  if (fstat(fd, &st) == -1)
+    return -1;
+  if (!S_ISREG(st.st_mode)) {
+    if (size < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    streaming = 1;
+  }
+  else if (size < 0) {
+    size = st.st_size;
+  }
+  tree_init(ctx, &param, NULL, size);
+
+  int direct = ctx->cfg.direct && S_ISREG(st.st_mode);
+  if (!direct && !streaming && size > 0) {
+    param.mapAddr = map_file(&ctx->place, fd, size);
+    if (param.mapAddr == MAP_FAILED) {
+      param.mapAddr = NULL;
+      streaming = 1;
+    }
+  }
+  if (!direct) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->engine = streaming ? HTREE_ENGINE_READ : HTREE_ENGINE_MMAP;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+  int res = 0;
+  if (direct)
+    res = direct_file(ctx, &param, fd);
+  else if (streaming)
+    res = stream_file(ctx->pool, &param, fd, 0);
+  if (res != 0) {
+    int err = errno;
+    tree_free(&param);
+    errno = err;
+    return -1;
+  }
+
+  *root = tree(ctx->pool, &param);
+  tree_free(&param);
+  if (param.mapAddr != NULL)
+    munmap(param.mapAddr, size);
+  return 0;
+}
+
+// map a big file and queue its tree, it's waited for later in finish_large. Returns -1 if the
+// file can't be mapped, the caller then hashes it as a small file
+static int start_large(struct htree* ctx, struct fileJob* job)
+{
+  struct htree_tree* param = &job->param;
+  struct stat st;
+
+  job->fd = open(job->path, O_RDONLY);
+  if (job->fd == -1) {
+    job->err = errno;
+    return 0;
+  }
+  fstat(job->fd, &st);
+  tree_init(ctx, param, NULL, st.st_size);
+  param->mapAddr = param->fileSize ? map_file(&ctx->place, job->fd, param->fileSize) : NULL;
+  if (param->mapAddr == MAP_FAILED) {
+    close(job->fd);
+    job->fd = -1;
+    return -1;
+  }
+  tree_start(ctx->pool, param);
+  return 0;
+}
+
+static void finish_large(struct fileJob* job)
+{
+  job->hash = tree_wait(&job->param);
+  tree_free(&job->param);
+  if (job->param.mapAddr != NULL)
+    munmap(job->param.mapAddr, job->param.fileSize);
+  close(job->fd);
+}
+
+// small files are one task each, big ones get split into num_threads chunks like a single file
+// and only a couple of them per worker are mapped at a time, the oldest one is waited for
+// before the next starts
+void htree_hash_files(struct htree* ctx, char* const* paths, uint count, uint64_t* hashes, int* errs)
+{
+  struct fileJob* jobs = calloc(count, sizeof(struct fileJob));
+  struct batch batch;
+  uint numWorkers = ctx->pool->numWorkers;
+  uint window = 2 * numWorkers;
+  uint* large = malloc((count + 1) * sizeof(uint));
+  uint numLarge = 0, numWaited = 0;
+
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.done, NULL);
+  batch.pending = 0;
+
+  for (uint i = 0; i < count; i++) {
+    struct fileJob* job = &jobs[i];
+    struct stat st;
+    job->path = paths[i];
+    job->fd = -1;
+    if (stat(job->path, &st) == -1) {
+      job->err = errno;
+      continue;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      job->err = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+      continue;
+    }
+
+    if (st.st_size >= SMALL_FILE) {
+      if (numLarge - numWaited == window)
+        finish_large(&jobs[large[numWaited++]]);
+      if (start_large(ctx, job) == 0) {
+        if (job->err == 0)
+          large[numLarge++] = i;
+        continue;
+      }
+    }
+
+    tree_init(ctx, &job->param, NULL, 0);
+    job->batch = &batch;
+    pthread_mutex_lock(&batch.lock);
+    batch.pending++;
+    pthread_mutex_unlock(&batch.lock);
+    struct task t = { TASK_FILE, 0, 1, &job->param, NULL, 0 };
+    pool_push(ctx->pool, i % numWorkers, t);
+  }
+
+  while (numWaited < numLarge)
+    finish_large(&jobs[large[numWaited++]]);
+  pthread_mutex_lock(&batch.lock);
+  while (batch.pending > 0)
+    pthread_cond_wait(&batch.done, &batch.lock);
+  pthread_mutex_unlock(&batch.lock);
+
+  for (uint i = 0; i < count; i++) {
+    hashes[i] = jobs[i].hash;
+    errs[i] = jobs[i].err;
+  }
+  pthread_mutex_destroy(&batch.lock);
+  pthread_cond_destroy(&batch.done);
+  free(large);
+  free(jobs);
+}
+
+// only the subtree is dirty, so its chunks are all that get hashed. Its ancestors are combined
+// too on the way to the root but those few hashes are thrown away
+int htree_hash_subtree(struct htree* ctx, const void* data, uint64_t len, uint node, uint64_t* hash)
+{
+  struct htree_tree param;
+  uint n = ctx->cfg.numThread;
+
+  if (node >= n) {
+    errno = ERANGE;
+    return -1;
+  }
+  tree_init(ctx, &param, data, len);
+  param.dirty = calloc(n, 1);
+  for (uint64_t first = node, last = node; first < n; first = 2 * first + 1, last = 2 * last + 2)
+    memset(param.dirty + first, 1, ((last < n) ? last + 1 : n) - first);
+  tree(ctx->pool, &param);
+  *hash = param.nodeHash[node];
+  tree_free(&param);
+  return 0;
+}
+
+int htree_hash_chunk(struct htree* ctx, const void* data, uint64_t len, uint node, uint64_t* hash)
+{
+  struct htree_tree param;
+
+  if (node >= ctx->cfg.numThread) {
+    errno = ERANGE;
+    return -1;
+  }
+  tree_init(ctx, &param, data, len);
+  *hash = hash_range(&param, node * param.chunkSize, param.chunkSize);
+  return 0;
+}
+
+uint64_t htree_combine(int kind, uint64_t own, const uint64_t* kids, uint numKids)
+{
+  return combine_hash(kind, own, kids, numKids);
+}
+
+uint64_t htree_hash_block(int kind, const void* data, uint64_t len)
+{
+  return hash_block(kind, data, len);
+}
+
+void* htree_map(struct htree* ctx, int fd, uint64_t size)
+{
+  return map_file(&ctx->place, fd, size);
+}
+
+struct htree_tree* htree_tree_build(struct htree* ctx, const void* data, uint64_t len)
+{
+  struct htree_tree* param = malloc(sizeof(struct htree_tree));
+
+  tree_init(ctx, param, data, len);
+  tree(ctx->pool, param);
+  return param;
+}
+
+int htree_tree_update(struct htree* ctx, struct htree_tree* param, const void* data, uint64_t len,
+                      const uint64_t* ranges, uint numRanges)
+{
+  int count;
+
+  // a new length moves every chunk boundary
+  if (len != param->fileSize) {
+    tree_free(param);
+    tree_init(ctx, param, data, len);
+    count = param->numThread;
+  }
+  else {
+    param->mapAddr = (uint8_t*)data;
+    if (param->dirty != NULL)
+      memset(param->dirty, 0, param->numThread);
+    count = mark_dirty(param, ranges, numRanges);
+  }
+  tree(ctx->pool, param);
+  return count;
+}
+
+uint64_t htree_tree_root(const struct htree_tree* param)
+{
+  return param->nodeHash[0];
+}
+
+void htree_tree_free(struct htree_tree* param)
+{
+  tree_free(param);
+  free(param);
+}
+
+struct htree_tree* htree_tree_load(struct htree* ctx, const char* path, const void* data, uint64_t len,
+                                   const struct stat* st, const uint64_t* ranges, uint numRanges, int* rehashed)
+{
+  struct htree_tree* param = malloc(sizeof(struct htree_tree));
+
+  tree_init(ctx, param, data, len);
+  *rehashed = sidecar_load(path, param, st, ranges, numRanges);
+  if (*rehashed < 0) {
+    int err = errno;
+    free(param);
+    errno = err;
+    return NULL;
+  }
+  tree(ctx->pool, param);
+  return param;
+}
+
+int htree_tree_save(const struct htree_tree* param, const char* path, const struct stat* st)
+{
+  return sidecar_save(path, param, st);
+}
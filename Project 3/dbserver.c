@@ -17,10 +17,22 @@
 #include <pthread.h>
 #include <sys/syscall.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "../Project 2/htree.h"
 
 // file to store records
 #define DB "entry.dat"
 
+// block checksums of the records, hashed with Project 2's libhtree: jenkins over BSIZE blocks,
+// the last one padded with zeros, and a tree with one block per node
+#define SIDECAR "entry.dat.sum"
+#define BSIZE HTREE_BSIZE
+// blocks scrubbed per second by default, and the least time between two scrub passes
+#define SCRUB_RATE 256
+#define SCRUB_INTERVAL 60
+
 void Usage(char *progname);
 void PrintOut(int fd, struct sockaddr *addr, size_t addrlen);
 void PrintReverseDNS(struct sockaddr *addr, size_t addrlen);
@@ -28,6 +40,46 @@ void PrintServerSide(int client_fd, int sock_family);
 int  Listen(char *portnum, int *sock_family);
 void* HandleClient(void* arg);
 
+// checksums and scrubbing
+uint64_t NodeHash(uint32_t node);
+void UpdatePath(uint32_t block);
+void LoadChecksums();
+uint64_t FoldIn();
+void SaveChecksums(uint32_t first);
+void GrowChecksums(uint32_t nblocks);
+void BuildTree();
+int  CheckBlock(int fd, uint32_t block, uint64_t dbSize, uint64_t expected);
+void* Scrub(void* arg);
+
+// sidecar header. Two slots for the last block's bytes follow it, then the block hashes. A save
+// writes the slot the header doesn't point at and the header goes last, so a crash in the
+// middle leaves the old header with its own tail
+struct sumHeader{
+  char magic[8];
+  uint64_t dbSize;      // bytes of entry.dat the checksums cover
+  uint64_t blockSize;
+  uint64_t tailSlot;    // which slot holds the last block
+};
+#define SUM_TAIL(slot) (sizeof(struct sumHeader) + (slot) * BSIZE)
+#define SUM_HASHES SUM_TAIL(2)
+
+// checksums of entry.dat in memory, everything here is guarded by lock and appends to entry.dat
+// take it too so the two can't get out of step
+struct checksums{
+  pthread_mutex_t lock;
+  int fd;                 // the sidecar
+  uint64_t dbSize;
+  uint32_t nblocks;
+  uint32_t capacity;
+  uint8_t tail[BSIZE];    // the last block as it was appended, zeros past the end
+  uint32_t tailSlot;      // slot the header on disk points at
+  uint64_t* blockHash;
+  uint64_t* nodeHash;     // subtree hashes, nodeHash[0] is the root htree gets with nblocks threads
+  uint8_t* bad;           // blocks already found corrupt
+  uint32_t corrupt;       // corruption counter
+};
+struct checksums sums = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
 // introduced a struct to circumvent arg passing limitations of pthread_create
 struct handlerParam{
   struct sockaddr_storage caddr;
@@ -36,10 +88,21 @@ struct handlerParam{
 };
 
 int main(int argc, char **argv) {
-  // Expect the port number as a command line argument.
-  if (argc != 2) {
+  // Expect the port number as a command line argument, and optionally the scrub rate
+  if (argc != 2 && argc != 3) {
     Usage(argv[0]);
   }
+  int scrubRate = SCRUB_RATE;
+  if (argc == 3 && sscanf(argv[2], "%d", &scrubRate) != 1) {
+    Usage(argv[0]);
+  }
+
+  // checksums are brought up to date before any client can append
+  LoadChecksums();
+  if (scrubRate > 0) {
+    pthread_t scrubThread;
+    pthread_create(&scrubThread, NULL, Scrub, &scrubRate);
+  }
 
   int sock_family;
   int listen_fd = Listen(argv[1], &sock_family);
@@ -75,7 +138,7 @@ int main(int argc, char **argv) {
 
 // from driver code, shows the correct command line usage for program
 void Usage(char *progname) {
-  printf("usage: %s port \n", progname);
+  printf("usage: %s port [scrub_blocks_per_sec, 0 for no scrubbing] \n", progname);
   exit(EXIT_FAILURE);
 }
 
@@ -280,18 +343,22 @@ void* HandleClient(void* arg) {
     // if client asks to store data into server,
     if(message->type == PUT){
       // create/open the data file
+      pthread_mutex_lock(&sums.lock);
     	FILE* file = fopen(DB, "a");
 
       // File open error
 	    if(file == NULL){
 		    printf("File not found");  
 		    response.type = FAIL;
+        pthread_mutex_unlock(&sums.lock);
 		    break;
 	    }
 
-      // write the given record into entry.dat and close the file
+      // write the given record into entry.dat and close the file, then hash what it added
       fwrite(&(message->rd), sizeof(struct record), 1, file);
 	    fclose(file);
+      FoldIn();
+      pthread_mutex_unlock(&sums.lock);
 
       // tells client record is successfully stored into file
 	    response.type = SUCCESS;
@@ -336,3 +403,259 @@ void* HandleClient(void* arg) {
   close(c_fd);
   return NULL;
 }
+
+// subtree hash of a node, its block's hash combined with its children's subtree hashes the way
+// htree's tree() does it
+uint64_t NodeHash(uint32_t node)
+{
+  uint32_t left = 2 * node + 1;
+  uint numKids = (left < sums.nblocks) + (left + 1 < sums.nblocks);
+  return htree_combine(HTREE_JENKINS, sums.blockHash[node], numKids ? sums.nodeHash + left : NULL, numKids);
+}
+
+// a changed block only changes the subtree hashes on its way up to the root
+void UpdatePath(uint32_t block)
+{
+  uint32_t node = block;
+  while (1) {
+    sums.nodeHash[node] = NodeHash(node);
+    if (node == 0)
+      break;
+    node = (node - 1) / 2;
+  }
+}
+
+// every subtree hash, children before their parents
+void BuildTree()
+{
+  for (uint32_t node = sums.nblocks; node-- > 0;)
+    sums.nodeHash[node] = NodeHash(node);
+}
+
+// make room for nblocks checksums
+void GrowChecksums(uint32_t nblocks)
+{
+  if (nblocks <= sums.capacity)
+    return;
+  uint32_t capacity = sums.capacity ? sums.capacity : 1024;
+  while (capacity < nblocks)
+    capacity *= 2;
+
+  sums.blockHash = realloc(sums.blockHash, capacity * sizeof(uint64_t));
+  sums.nodeHash = realloc(sums.nodeHash, capacity * sizeof(uint64_t));
+  sums.bad = realloc(sums.bad, capacity);
+  if (sums.blockHash == NULL || sums.nodeHash == NULL || sums.bad == NULL) {
+    fprintf(stderr, "Out of memory for checksums \n");
+    exit(EXIT_FAILURE);
+  }
+  memset(sums.bad + sums.capacity, 0, capacity - sums.capacity);
+  sums.capacity = capacity;
+}
+
+// reads the sidecar, or starts over if there is none or it doesn't fit, then hashes whatever
+// was added to entry.dat after it was last written
+void LoadChecksums()
+{
+  sums.fd = open(SIDECAR, O_RDWR | O_CREAT, 0644);
+  if (sums.fd == -1) {
+    perror(SIDECAR);
+    exit(EXIT_FAILURE);
+  }
+
+  struct sumHeader header;
+  struct stat sumStat;
+  int loaded = 0;
+  fstat(sums.fd, &sumStat);
+  if (pread(sums.fd, &header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(header.magic, "DBSUM3", 7) == 0 && header.blockSize == BSIZE && header.tailSlot < 2) {
+    uint32_t nblocks = (header.dbSize + BSIZE - 1) / BSIZE;
+    size_t length = nblocks * sizeof(uint64_t);
+    GrowChecksums(nblocks);
+    if ((uint64_t)sumStat.st_size >= SUM_HASHES + length &&
+        pread(sums.fd, sums.tail, BSIZE, SUM_TAIL(header.tailSlot)) == BSIZE &&
+        pread(sums.fd, sums.blockHash, length, SUM_HASHES) == (ssize_t)length) {
+      sums.nblocks = nblocks;
+      sums.dbSize = header.dbSize;
+      sums.tailSlot = header.tailSlot;
+      // a crash before the header was written may have left a newer hash for the last block,
+      // the tail the header points at is the one to trust
+      if (sums.dbSize % BSIZE)
+        sums.blockHash[nblocks - 1] = htree_hash_block(HTREE_JENKINS, sums.tail, BSIZE);
+      BuildTree();
+      loaded = 1;
+    }
+  }
+  if (!loaded) {
+    memset(sums.tail, 0, BSIZE);
+    if (sumStat.st_size == 0)
+      printf("No %s yet, hashing all of %s \n", SIDECAR, DB);
+    else
+      printf("%s is unusable, hashing all of %s \n", SIDECAR, DB);
+    // an empty database still gets a valid sidecar, next time it loads
+    SaveChecksums(0);
+  }
+
+  uint64_t hashed = FoldIn();
+  printf("Checksums of %s: %u blocks, root %" PRIu64 ", %" PRIu64 " bytes hashed at startup \n",
+         DB, sums.nblocks, sums.nblocks ? sums.nodeHash[0] : 0, hashed);
+}
+
+// hashes what was appended to entry.dat since the checksums last covered it. New bytes go into
+// the copy of the last block and that copy is hashed, so bytes already covered are never read
+// again and a corrupt one stays caught. Returns how many bytes it hashed, caller holds the lock
+uint64_t FoldIn()
+{
+  int fd = open(DB, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  struct stat dbStat;
+  fstat(fd, &dbStat);
+
+  // records are only ever appended, a shorter file was cut or replaced behind our back
+  if ((uint64_t)dbStat.st_size < sums.dbSize) {
+    sums.corrupt++;
+    printf("%s is shorter than its checksums say (%" PRIu64 " < %" PRIu64 " bytes), %u corrupt, rehashing it \n",
+           DB, (uint64_t)dbStat.st_size, sums.dbSize, sums.corrupt);
+    sums.dbSize = 0;
+    sums.nblocks = 0;
+    memset(sums.tail, 0, BSIZE);
+    memset(sums.bad, 0, sums.capacity);
+  }
+
+  uint64_t start = sums.dbSize;
+  while (sums.dbSize < (uint64_t)dbStat.st_size) {
+    uint64_t offset = sums.dbSize % BSIZE;
+    uint64_t want = (uint64_t)dbStat.st_size - sums.dbSize;
+    ssize_t res = pread(fd, sums.tail + offset, want < BSIZE - offset ? want : BSIZE - offset, sums.dbSize);
+    if (res == -1 && errno == EINTR)
+      continue;
+    if (res <= 0)
+      break;
+
+    uint32_t block = sums.dbSize / BSIZE;
+    GrowChecksums(block + 1);
+    if (block >= sums.nblocks)
+      sums.nblocks = block + 1;
+    sums.dbSize += res;
+    sums.blockHash[block] = htree_hash_block(HTREE_JENKINS, sums.tail, BSIZE);
+
+    // a full block is done with, the next one starts out as zeros
+    if (sums.dbSize % BSIZE == 0)
+      memset(sums.tail, 0, BSIZE);
+  }
+  // the records have to be on disk before a header that covers them
+  if (sums.dbSize != start)
+    fdatasync(fd);
+  close(fd);
+  if (sums.dbSize == start)
+    return 0;
+
+  // a PUT touches one block, that's one path to the root. Lots of blocks rebuild the tree
+  uint32_t first = start / BSIZE;
+  if (sums.nblocks - first > 64)
+    BuildTree();
+  else
+    for (uint32_t block = first; block < sums.nblocks; block++)
+      UpdatePath(block);
+  SaveChecksums(first);
+  return sums.dbSize - start;
+}
+
+// writes the block hashes from first on and the last block into the free slot, syncs them, then
+// writes the header pointing at that slot and syncs it. Hashes before first never change and the
+// last block's is rebuilt from the tail on load, so the old header is still right until the new
+// one lands
+void SaveChecksums(uint32_t first)
+{
+  struct sumHeader header;
+  memset(&header, 0, sizeof(header));
+  strcpy(header.magic, "DBSUM3");
+  header.dbSize = sums.dbSize;
+  header.blockSize = BSIZE;
+  header.tailSlot = !sums.tailSlot;
+
+  size_t length = (sums.nblocks - first) * sizeof(uint64_t);
+  if (pwrite(sums.fd, sums.blockHash + first, length, SUM_HASHES + first * sizeof(uint64_t)) != (ssize_t)length ||
+      pwrite(sums.fd, sums.tail, BSIZE, SUM_TAIL(header.tailSlot)) != BSIZE ||
+      fdatasync(sums.fd) == -1 ||
+      pwrite(sums.fd, &header, sizeof(header), 0) != sizeof(header) ||
+      fdatasync(sums.fd) == -1) {
+    fprintf(stderr, "Failed to write %s:%s \n", SIDECAR, strerror(errno));
+    return;
+  }
+  sums.tailSlot = header.tailSlot;
+}
+
+// hashes a block of entry.dat as it is on disk, up to dbSize and padded with zeros, and compares
+// it with expected
+int CheckBlock(int fd, uint32_t block, uint64_t dbSize, uint64_t expected)
+{
+  uint8_t buf[BSIZE];
+  uint64_t start = (uint64_t)block * BSIZE;
+  uint64_t length = dbSize - start < BSIZE ? dbSize - start : BSIZE;
+  memset(buf + length, 0, BSIZE - length);
+  if (pread(fd, buf, length, start) != (ssize_t)length)
+    return 0;
+  return htree_hash_block(HTREE_JENKINS, buf, BSIZE) == expected;
+}
+
+// background scrub, checks every block of entry.dat against its checksum at most rate blocks a
+// second and then waits out the rest of SCRUB_INTERVAL. It runs at the lowest cpu and idle io
+// priority and takes the lock only to look up a checksum, or to check a block again that didn't
+// match (the last block may have just grown), so GETs hardly notice it
+void* Scrub(void* arg)
+{
+  int rate = *(int*) arg;
+  uint64_t step = 1000000000ull / rate;
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+  // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE, glibc has no wrapper for it
+  syscall(SYS_ioprio_set, 1, tid, 3 << 13);
+
+  while (1) {
+    struct timespec passStart, next;
+    clock_gettime(CLOCK_MONOTONIC, &passStart);
+    next = passStart;
+    uint32_t checked = 0;
+
+    int fd = open(DB, O_RDONLY);
+    for (uint32_t block = 0; fd != -1; block++) {
+      pthread_mutex_lock(&sums.lock);
+      if (block >= sums.nblocks) {
+        pthread_mutex_unlock(&sums.lock);
+        break;
+      }
+      uint64_t dbSize = sums.dbSize;
+      uint64_t expected = sums.blockHash[block];
+      pthread_mutex_unlock(&sums.lock);
+
+      if (!CheckBlock(fd, block, dbSize, expected)) {
+        pthread_mutex_lock(&sums.lock);
+        if (!CheckBlock(fd, block, sums.dbSize, sums.blockHash[block]) && !sums.bad[block]) {
+          sums.bad[block] = 1;
+          sums.corrupt++;
+          printf("Scrub: block %u of %s doesn't match its checksum, %u corrupt \n", block, DB, sums.corrupt);
+        }
+        pthread_mutex_unlock(&sums.lock);
+      }
+      checked++;
+
+      // throttle
+      next.tv_nsec += step;
+      next.tv_sec += next.tv_nsec / 1000000000;
+      next.tv_nsec %= 1000000000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    if (fd != -1)
+      close(fd);
+
+    if (checked > 0) {
+      pthread_mutex_lock(&sums.lock);
+      printf("Scrub pass: %u blocks checked, root %" PRIu64 ", %u corrupt \n", checked, sums.nblocks ? sums.nodeHash[0] : 0, sums.corrupt);
+      pthread_mutex_unlock(&sums.lock);
+    }
+    passStart.tv_sec += SCRUB_INTERVAL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &passStart, NULL);
+  }
+  return NULL;
+}